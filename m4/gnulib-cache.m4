@@ -67,6 +67,7 @@
 #  fopen-safer \
 #  fseeko \
 #  gendocs \
+#  gethrxtime \
 #  getopt-gnu \
 #  gettext-h \
 #  git-version-gen \
@@ -136,6 +137,7 @@ gl_MODULES([
   fopen-safer
   fseeko
   gendocs
+  gethrxtime
   getopt-gnu
   gettext-h
   git-version-gen
@@ -43,7 +43,10 @@
 DECLARE (m4___file__);
 DECLARE (m4___line__);
 DECLARE (m4___program__);
+DECLARE (m4_append);
 DECLARE (m4_builtin);
+DECLARE (m4_caseof);
+DECLARE (m4_casetable);
 DECLARE (m4_changecom);
 DECLARE (m4_changequote);
 #ifdef ENABLE_CHANGEWORD
@@ -62,6 +65,7 @@ DECLARE (m4_errprint);
 DECLARE (m4_esyscmd);
 DECLARE (m4_eval);
 DECLARE (m4_format);
+DECLARE (m4_ifcase);
 DECLARE (m4_ifdef);
 DECLARE (m4_ifelse);
 DECLARE (m4_include);
@@ -93,62 +97,66 @@ DECLARE (m4_undivert);
 static builtin const builtin_tab[] =
 {
 
-  /* name               GNUext  macros  blind   function */
+  /* name               GNUext  macros  blind   lazy    function */
 
-  { "__file__",         true,   false,  false,  m4___file__ },
-  { "__line__",         true,   false,  false,  m4___line__ },
-  { "__program__",      true,   false,  false,  m4___program__ },
-  { "builtin",          true,   true,   true,   m4_builtin },
-  { "changecom",        false,  false,  false,  m4_changecom },
-  { "changequote",      false,  false,  false,  m4_changequote },
+  { "__file__",         true,   false,  false,  false,  m4___file__ },
+  { "__line__",         true,   false,  false,  false,  m4___line__ },
+  { "__program__",      true,   false,  false,  false,  m4___program__ },
+  { "append",           true,   false,  true,   false,  m4_append },
+  { "builtin",          true,   true,   true,   false,  m4_builtin },
+  { "caseof",           true,   false,  true,   false,  m4_caseof },
+  { "casetable",        true,   false,  true,   false,  m4_casetable },
+  { "changecom",        false,  false,  false,  false,  m4_changecom },
+  { "changequote",      false,  false,  false,  false,  m4_changequote },
 #ifdef ENABLE_CHANGEWORD
-  { "changeword",       true,   false,  true,   m4_changeword },
+  { "changeword",       true,   false,  true,   false,  m4_changeword },
 #endif
-  { "debugmode",        true,   false,  false,  m4_debugmode },
-  { "debugfile",        true,   false,  false,  m4_debugfile },
-  { "decr",             false,  false,  true,   m4_decr },
-  { "define",           false,  true,   true,   m4_define },
-  { "defn",             false,  false,  true,   m4_defn },
-  { "divert",           false,  false,  false,  m4_divert },
-  { "divnum",           false,  false,  false,  m4_divnum },
-  { "dnl",              false,  false,  false,  m4_dnl },
-  { "dumpdef",          false,  false,  false,  m4_dumpdef },
-  { "errprint",         false,  false,  true,   m4_errprint },
-  { "esyscmd",          true,   false,  true,   m4_esyscmd },
-  { "eval",             false,  false,  true,   m4_eval },
-  { "format",           true,   false,  true,   m4_format },
-  { "ifdef",            false,  false,  true,   m4_ifdef },
-  { "ifelse",           false,  false,  true,   m4_ifelse },
-  { "include",          false,  false,  true,   m4_include },
-  { "incr",             false,  false,  true,   m4_incr },
-  { "index",            false,  false,  true,   m4_index },
-  { "indir",            true,   true,   true,   m4_indir },
-  { "len",              false,  false,  true,   m4_len },
-  { "m4exit",           false,  false,  false,  m4_m4exit },
-  { "m4wrap",           false,  false,  true,   m4_m4wrap },
-  { "maketemp",         false,  false,  true,   m4_maketemp },
-  { "mkstemp",          false,  false,  true,   m4_mkstemp },
-  { "patsubst",         true,   false,  true,   m4_patsubst },
-  { "popdef",           false,  false,  true,   m4_popdef },
-  { "pushdef",          false,  true,   true,   m4_pushdef },
-  { "regexp",           true,   false,  true,   m4_regexp },
-  { "shift",            false,  false,  true,   m4_shift },
-  { "sinclude",         false,  false,  true,   m4_sinclude },
-  { "substr",           false,  false,  true,   m4_substr },
-  { "syscmd",           false,  false,  true,   m4_syscmd },
-  { "sysval",           false,  false,  false,  m4_sysval },
-  { "traceoff",         false,  false,  false,  m4_traceoff },
-  { "traceon",          false,  false,  false,  m4_traceon },
-  { "translit",         false,  false,  true,   m4_translit },
-  { "undefine",         false,  false,  true,   m4_undefine },
-  { "undivert",         false,  false,  false,  m4_undivert },
-
-  { 0,                  false,  false,  false,  0 },
+  { "debugmode",        true,   false,  false,  false,  m4_debugmode },
+  { "debugfile",        true,   false,  false,  false,  m4_debugfile },
+  { "decr",             false,  false,  true,   false,  m4_decr },
+  { "define",           false,  true,   true,   false,  m4_define },
+  { "defn",             false,  false,  true,   false,  m4_defn },
+  { "divert",           false,  false,  false,  false,  m4_divert },
+  { "divnum",           false,  false,  false,  false,  m4_divnum },
+  { "dnl",              false,  false,  false,  false,  m4_dnl },
+  { "dumpdef",          false,  false,  false,  false,  m4_dumpdef },
+  { "errprint",         false,  false,  true,   false,  m4_errprint },
+  { "esyscmd",          true,   false,  true,   false,  m4_esyscmd },
+  { "eval",             false,  false,  true,   false,  m4_eval },
+  { "format",           true,   false,  true,   false,  m4_format },
+  { "ifcase",           true,   false,  true,   true,   m4_ifcase },
+  { "ifdef",            false,  false,  true,   false,  m4_ifdef },
+  { "ifelse",           false,  false,  true,   false,  m4_ifelse },
+  { "include",          false,  false,  true,   false,  m4_include },
+  { "incr",             false,  false,  true,   false,  m4_incr },
+  { "index",            false,  false,  true,   false,  m4_index },
+  { "indir",            true,   true,   true,   false,  m4_indir },
+  { "len",              false,  false,  true,   false,  m4_len },
+  { "m4exit",           false,  false,  false,  false,  m4_m4exit },
+  { "m4wrap",           false,  false,  true,   false,  m4_m4wrap },
+  { "maketemp",         false,  false,  true,   false,  m4_maketemp },
+  { "mkstemp",          false,  false,  true,   false,  m4_mkstemp },
+  { "patsubst",         true,   false,  true,   false,  m4_patsubst },
+  { "popdef",           false,  false,  true,   false,  m4_popdef },
+  { "pushdef",          false,  true,   true,   false,  m4_pushdef },
+  { "regexp",           true,   false,  true,   false,  m4_regexp },
+  { "shift",            false,  false,  true,   false,  m4_shift },
+  { "sinclude",         false,  false,  true,   false,  m4_sinclude },
+  { "substr",           false,  false,  true,   false,  m4_substr },
+  { "syscmd",           false,  false,  true,   false,  m4_syscmd },
+  { "sysval",           false,  false,  false,  false,  m4_sysval },
+  { "traceoff",         false,  false,  false,  false,  m4_traceoff },
+  { "traceon",          false,  false,  false,  false,  m4_traceon },
+  { "translit",         false,  false,  true,   false,  m4_translit },
+  { "undefine",         false,  false,  true,   false,  m4_undefine },
+  { "undivert",         false,  false,  false,  false,  m4_undivert },
+
+  { 0,                  false,  false,  false,  false,  0 },
 
   /* placeholder is intentionally stuck after the table end delimiter,
      so that we can easily find it, while not treating it as a real
      builtin.  */
-  { "placeholder",      true,   false,  false,  m4_placeholder },
+  { "placeholder",      true,   false,  false,  false,  m4_placeholder },
 };
 
 static predefined const predefined_tab[] =
@@ -170,37 +178,124 @@ static predefined const predefined_tab[] =
   { NULL,       NULL,           NULL },
 };
 
-/*----------------------------------------.
-| Find the builtin, which lives on ADDR.  |
-`----------------------------------------*/
+/* The placeholder, after the end of builtin_tab proper.  */
+#define PLACEHOLDER_BUILTIN \
+  (&builtin_tab[sizeof builtin_tab / sizeof *builtin_tab - 1])
 
-const builtin * ATTRIBUTE_PURE
-find_builtin_by_addr (builtin_func *func)
+/* Hash tables of builtin_tab, by name and by function address, filled
+   on first use.  Each bucket holds the index of a builtin plus one, or
+   0 when empty, and a builtin whose bucket is taken goes in the next
+   free one.  There are at least twice as many buckets as builtins, so
+   a lookup rarely looks at more than one entry.  */
+#define BUILTIN_BUCKETS 128
+
+verify (sizeof builtin_tab / sizeof *builtin_tab <= BUILTIN_BUCKETS / 2);
+
+static unsigned char builtin_by_name[BUILTIN_BUCKETS];
+static unsigned char builtin_by_addr[BUILTIN_BUCKETS];
+static bool builtin_buckets_ready;
+
+/* Return the home bucket of the builtin called NAME.  */
+static size_t ATTRIBUTE_PURE
+name_bucket (const char *name)
+{
+  size_t length = strlen (name);
+  size_t h = length;
+
+  if (length > 0)
+    h = h * 61 + to_uchar (name[0]) * 7 + to_uchar (name[length - 1])
+      + to_uchar (name[length / 2]) * 3;
+  return h % BUILTIN_BUCKETS;
+}
+
+/* Return the home bucket of the builtin whose function is FUNC.  */
+static size_t ATTRIBUTE_CONST
+addr_bucket (builtin_func *func)
+{
+  uintptr_t addr = (uintptr_t) func;
+
+  return ((addr >> 4) ^ (addr >> 11)) % BUILTIN_BUCKETS;
+}
+
+static void
+fill_builtin_buckets (void)
+{
+  size_t i;
+  size_t b;
+
+  for (i = 0; builtin_tab[i].name != NULL; i++)
+    {
+      for (b = name_bucket (builtin_tab[i].name); builtin_by_name[b] != 0;
+           b = (b + 1) % BUILTIN_BUCKETS)
+        ;
+      builtin_by_name[b] = i + 1;
+      for (b = addr_bucket (builtin_tab[i].func); builtin_by_addr[b] != 0;
+           b = (b + 1) % BUILTIN_BUCKETS)
+        ;
+      builtin_by_addr[b] = i + 1;
+    }
+  builtin_buckets_ready = true;
+}
+
+/* Look FUNC up in builtin_by_addr, once it is filled.  */
+static const builtin * ATTRIBUTE_PURE
+lookup_builtin_by_addr (builtin_func *func)
 {
   const builtin *bp;
+  size_t b;
 
-  for (bp = &builtin_tab[0]; bp->name != NULL; bp++)
-    if (bp->func == func)
-      return bp;
+  for (b = addr_bucket (func); builtin_by_addr[b] != 0;
+       b = (b + 1) % BUILTIN_BUCKETS)
+    {
+      bp = &builtin_tab[builtin_by_addr[b] - 1];
+      if (bp->func == func)
+        return bp;
+    }
   if (func == m4_placeholder)
-    return bp + 1;
+    return PLACEHOLDER_BUILTIN;
   return NULL;
 }
 
+/* Look NAME up in builtin_by_name, once it is filled.  */
+static const builtin * ATTRIBUTE_PURE
+lookup_builtin_by_name (const char *name)
+{
+  const builtin *bp;
+  size_t b;
+
+  for (b = name_bucket (name); builtin_by_name[b] != 0;
+       b = (b + 1) % BUILTIN_BUCKETS)
+    {
+      bp = &builtin_tab[builtin_by_name[b] - 1];
+      if (STREQ (bp->name, name))
+        return bp;
+    }
+  return PLACEHOLDER_BUILTIN;
+}
+
+/*----------------------------------------.
+| Find the builtin, which lives on ADDR.  |
+`----------------------------------------*/
+
+const builtin *
+find_builtin_by_addr (builtin_func *func)
+{
+  if (!builtin_buckets_ready)
+    fill_builtin_buckets ();
+  return lookup_builtin_by_addr (func);
+}
+
 /*----------------------------------------------------------.
 | Find the builtin, which has NAME.  On failure, return the |
 | placeholder builtin.                                      |
 `----------------------------------------------------------*/
 
-const builtin * ATTRIBUTE_PURE
+const builtin *
 find_builtin_by_name (const char *name)
 {
-  const builtin *bp;
-
-  for (bp = &builtin_tab[0]; bp->name != NULL; bp++)
-    if (STREQ (bp->name, name))
-      return bp;
-  return bp + 1;
+  if (!builtin_buckets_ready)
+    fill_builtin_buckets ();
+  return lookup_builtin_by_name (name);
 }
 
 /*----------------------------------------------------------------.
@@ -217,9 +312,13 @@ define_builtin (const char *name, const builtin *bp, symbol_lookup mode)
   SYMBOL_TYPE (sym) = TOKEN_FUNC;
   SYMBOL_MACRO_ARGS (sym) = bp->groks_macro_args;
   SYMBOL_BLIND_NO_ARGS (sym) = bp->blind_if_no_args;
+  SYMBOL_LAZY_BRANCHES (sym) = bp->lazy_branches;
   SYMBOL_FUNC (sym) = bp->func;
 }
 
+/* Number of regular expressions compiled, for --stats.  */
+uintmax_t regex_compile_count;
+
 /* Storage for the compiled regular expression of
    --warn-macro-sequence.  */
 static struct re_pattern_buffer macro_sequence_buf;
@@ -259,6 +358,7 @@ set_macro_sequence (const char *regexp)
       return;
     }
 
+  regex_compile_count++;
   msg = re_compile_pattern (regexp, strlen (regexp), &macro_sequence_buf);
   if (msg != NULL)
     m4_failure (0, _("--warn-macro-sequence: bad regular expression `%s': %s"),
@@ -279,6 +379,56 @@ free_macro_sequence (void)
   free_pattern_buffer (&macro_sequence_buf, &macro_sequence_regs);
 }
 
+/*----------------------------------------------------.
+| Print regular expression statistics, for --stats.   |
+`----------------------------------------------------*/
+
+void
+builtin_print_stats (void)
+{
+  stats_message ("regex: %ju compiled", regex_compile_count);
+}
+
+/*-------------------------------------------------------------------.
+| Implement --warn-macro-sequence, for TEXT being defined as part of |
+| the macro NAME.  Matches that end within the first CHECKED bytes,  |
+| which were already checked before an append, are not reported      |
+| again; the search still starts at the beginning of TEXT, since a   |
+| sequence may span the old text and the appended one.               |
+`-------------------------------------------------------------------*/
+
+static void
+check_macro_sequence (const char *name, char *text, size_t checked)
+{
+  regoff_t offset = 0;
+  size_t len = strlen (text);
+
+  while ((offset = re_search (&macro_sequence_buf, text, len, offset,
+                              len - offset, &macro_sequence_regs)) >= 0)
+    {
+      /* Skip empty matches.  */
+      if (macro_sequence_regs.start[0] == macro_sequence_regs.end[0])
+        offset++;
+      else if (macro_sequence_regs.end[0] <= checked)
+        offset = macro_sequence_regs.end[0];
+      else
+        {
+          char tmp;
+          offset = macro_sequence_regs.end[0];
+          tmp = text[offset];
+          text[offset] = '\0';
+          M4ERROR ((warning_status, 0,
+                    _("Warning: definition of `%s' contains sequence `%s'"),
+                    name, text + macro_sequence_regs.start[0]));
+          text[offset] = tmp;
+        }
+    }
+  if (offset == -2)
+    M4ERROR ((warning_status, 0,
+              _("error checking --warn-macro-sequence for macro `%s'"),
+              name));
+}
+
 /*-----------------------------------------------------------------.
 | Define a predefined or user-defined macro, with name NAME, and   |
 | expansion TEXT.  MODE destinguishes between the "define" and the |
@@ -289,44 +439,12 @@ void
 define_user_macro (const char *name, const char *text, symbol_lookup mode)
 {
   symbol *s;
-  char *defn = xstrdup (text ? text : "");
 
   s = lookup_symbol (name, mode);
-  if (SYMBOL_TYPE (s) == TOKEN_TEXT)
-    free (SYMBOL_TEXT (s));
+  set_symbol_text (s, text ? text : "");
 
-  SYMBOL_TYPE (s) = TOKEN_TEXT;
-  SYMBOL_TEXT (s) = defn;
-
-  /* Implement --warn-macro-sequence.  */
   if (macro_sequence_inuse && text)
-    {
-      regoff_t offset = 0;
-      size_t len = strlen (defn);
-
-      while ((offset = re_search (&macro_sequence_buf, defn, len, offset,
-                                  len - offset, &macro_sequence_regs)) >= 0)
-        {
-          /* Skip empty matches.  */
-          if (macro_sequence_regs.start[0] == macro_sequence_regs.end[0])
-            offset++;
-          else
-            {
-              char tmp;
-              offset = macro_sequence_regs.end[0];
-              tmp = defn[offset];
-              defn[offset] = '\0';
-              M4ERROR ((warning_status, 0,
-                        _("Warning: definition of `%s' contains sequence `%s'"),
-                        name, defn + macro_sequence_regs.start[0]));
-              defn[offset] = tmp;
-            }
-        }
-      if (offset == -2)
-        M4ERROR ((warning_status, 0,
-                  _("error checking --warn-macro-sequence for macro `%s'"),
-                  name));
-    }
+    check_macro_sequence (name, SYMBOL_TEXT (s), 0);
 }
 
 /*-----------------------------------------------.
@@ -587,6 +705,44 @@ m4_define (struct obstack *obs MAYBE_UNUSED, int argc, token_data **argv)
   define_macro (argc, argv, SYMBOL_INSERT);
 }
 
+/* Append to the definition of a macro, without copying what is
+   already there; a macro that is not defined yet is defined.  */
+
+static void
+m4_append (struct obstack *obs MAYBE_UNUSED, int argc, token_data **argv)
+{
+  symbol *s;
+  char *text;
+
+  if (bad_argc (argv[0], argc, 3, 3))
+    return;
+
+  s = lookup_symbol (ARG (1), SYMBOL_LOOKUP);
+  if (s == NULL || SYMBOL_TYPE (s) == TOKEN_VOID)
+    define_user_macro (ARG (1), ARG (2), SYMBOL_INSERT);
+  else if (SYMBOL_TYPE (s) == TOKEN_FUNC)
+    M4ERROR ((warning_status, 0,
+              _("Warning: cannot append to builtin `%s'"), ARG (1)));
+  else if (SYMBOL_PENDING_EXPANSIONS (s) > 0)
+    {
+      /* A call of the macro is still collecting its arguments, and
+         must see the old definition, as if define had been used.  */
+      size_t length = strlen (SYMBOL_TEXT (s));
+      text = xcharalloc (length + strlen (ARG (2)) + 1);
+      memcpy (text, SYMBOL_TEXT (s), length);
+      strcpy (text + length, ARG (2));
+      define_user_macro (ARG (1), text, SYMBOL_INSERT);
+      free (text);
+    }
+  else
+    {
+      text = append_symbol_text (s, ARG (2));
+      if (macro_sequence_inuse)
+        check_macro_sequence (ARG (1), SYMBOL_TEXT (s),
+                              text - SYMBOL_TEXT (s));
+    }
+}
+
 static void
 m4_undefine (struct obstack *obs MAYBE_UNUSED, int argc, token_data **argv)
 {
@@ -680,6 +836,35 @@ m4_ifelse (struct obstack *obs, int argc, token_data **argv)
 
   obstack_grow (obs, result, strlen (result));
 }
+
+/* Ifcase takes the same arguments as ifelse, but only the branch that
+   ifelse would select gets expanded; collect_arguments () leaves the
+   other branches, and any arguments after the selected one, empty.  */
+
+static void
+m4_ifcase (struct obstack *obs, int argc, token_data **argv)
+{
+  m4_ifelse (obs, argc, argv);
+}
+
+/* Casetable defines a table for caseof to look its second argument up
+   in, without comparing it against each key in turn.  */
+
+static void
+m4_casetable (struct obstack *obs MAYBE_UNUSED, int argc, token_data **argv)
+{
+  if (bad_argc (argv[0], argc, 2, -1))
+    return;
+  define_case_table (ARG (1), argc - 2, argv + 2);
+}
+
+static void
+m4_caseof (struct obstack *obs, int argc, token_data **argv)
+{
+  if (bad_argc (argv[0], argc, 3, 3))
+    return;
+  expand_case (obs, ARG (1), ARG (2));
+}
 
 /*-------------------------------------------------------------------.
 | The function dump_symbol () is for use by "dumpdef".  It builds up |
@@ -906,6 +1091,8 @@ m4_defn (struct obstack *obs, int argc, token_data **argv)
           obstack_grow (obs, lquote.string, lquote.length);
           obstack_grow (obs, SYMBOL_TEXT (s), strlen (SYMBOL_TEXT (s)));
           obstack_grow (obs, rquote.string, rquote.length);
+          if (argc == 2)
+            offer_symbol_text (s);
           break;
 
         case TOKEN_FUNC:
@@ -1564,6 +1751,7 @@ m4_m4exit (struct obstack *obs MAYBE_UNUSED, int argc, token_data **argv)
   /* Change debug stream back to stderr, to force flushing debug stream and
      detect any errors it might have encountered.  */
   debug_set_output (NULL);
+  trace_log_close ();
   debug_flush_files ();
   if (exit_code == EXIT_SUCCESS && retcode != EXIT_SUCCESS)
     exit_code = retcode;
@@ -1730,6 +1918,147 @@ m4_debugfile (struct obstack *obs MAYBE_UNUSED, int argc, token_data **argv)
    "substr", "translit", "format", "regexp" and "patsubst".  The last
    three are GNU specific.  */
 
+/*-------------------------------------------------------------------.
+| With --utf8, "len", "index", "substr" and "translit" count         |
+| characters rather than bytes.  ASCII text is still handled a byte  |
+| at a time: ascii_prefix () returns how many bytes S starts with    |
+| before its first non-ASCII one, testing a whole machine word at a  |
+| time, so that only the non-ASCII parts of a string go through the  |
+| decoder.  A byte that is not part of a well formed UTF-8 sequence  |
+| counts as one character, decoded as UTF8_BAD_BYTE plus its value   |
+| so that it stays apart from every code point.                      |
+`-------------------------------------------------------------------*/
+
+#define UTF8_BAD_BYTE 0x110000
+
+static size_t
+ascii_prefix (const char *s, size_t len)
+{
+  const size_t high = SIZE_MAX / UCHAR_MAX * 0x80;
+  const char *p = s;
+  const char *end = s + len;
+  size_t word;
+
+  while ((size_t) (end - p) >= sizeof word)
+    {
+      memcpy (&word, p, sizeof word);
+      if (word & high)
+        break;
+      p += sizeof word;
+    }
+  while (p < end && to_uchar (*p) < 0x80)
+    p++;
+  return p - s;
+}
+
+/* Decode the character at S, which must be before END, and store its
+   length in bytes in *LENGTH.  */
+
+static unsigned int
+utf8_decode (const char *s, const char *end, size_t *length)
+{
+  unsigned char ch = *s;
+  size_t count;
+  size_t i;
+  unsigned int wc;
+
+  *length = 1;
+  if (ch < 0x80)
+    return ch;
+  if (ch < 0xC2 || ch > 0xF4)
+    return UTF8_BAD_BYTE + ch;
+  count = ch < 0xE0 ? 2 : ch < 0xF0 ? 3 : 4;
+  if ((size_t) (end - s) < count)
+    return UTF8_BAD_BYTE + ch;
+  wc = ch & (0x7F >> count);
+  for (i = 1; i < count; i++)
+    {
+      if ((to_uchar (s[i]) & 0xC0) != 0x80)
+        return UTF8_BAD_BYTE + ch;
+      wc = (wc << 6) | (to_uchar (s[i]) & 0x3F);
+    }
+  if ((count == 3 && (wc < 0x800 || (wc >= 0xD800 && wc <= 0xDFFF)))
+      || (count == 4 && (wc < 0x10000 || wc > 0x10FFFF)))
+    return UTF8_BAD_BYTE + ch;
+  *length = count;
+  return wc;
+}
+
+/* Append the encoding of WC, as returned by utf8_decode (), to OBS.  */
+
+static void
+utf8_grow (struct obstack *obs, unsigned int wc)
+{
+  if (wc < 0x80)
+    obstack_1grow (obs, wc);
+  else if (wc >= UTF8_BAD_BYTE)
+    obstack_1grow (obs, wc - UTF8_BAD_BYTE);
+  else
+    {
+      if (wc < 0x800)
+        obstack_1grow (obs, 0xC0 | (wc >> 6));
+      else
+        {
+          if (wc < 0x10000)
+            obstack_1grow (obs, 0xE0 | (wc >> 12));
+          else
+            {
+              obstack_1grow (obs, 0xF0 | (wc >> 18));
+              obstack_1grow (obs, 0x80 | ((wc >> 12) & 0x3F));
+            }
+          obstack_1grow (obs, 0x80 | ((wc >> 6) & 0x3F));
+        }
+      obstack_1grow (obs, 0x80 | (wc & 0x3F));
+    }
+}
+
+/* Return the end of the first COUNT characters of S, or END if there
+   are fewer.  */
+
+static const char *
+utf8_skip (const char *s, const char *end, size_t count)
+{
+  size_t length;
+
+  while (count > 0)
+    {
+      length = ascii_prefix (s, end - s);
+      if (length >= count)
+        return s + count;
+      s += length;
+      count -= length;
+      if (s == end)
+        break;
+      utf8_decode (s, end, &length);
+      s += length;
+      count--;
+    }
+  return s;
+}
+
+/* Return the number of characters in the LEN bytes at S.  */
+
+static size_t
+utf8_count (const char *s, size_t len)
+{
+  const char *end = s + len;
+  size_t count = 0;
+  size_t length;
+
+  while (1)
+    {
+      length = ascii_prefix (s, end - s);
+      count += length;
+      s += length;
+      if (s == end)
+        break;
+      utf8_decode (s, end, &length);
+      s += length;
+      count++;
+    }
+  return count;
+}
+
 /*---------------------------------------------.
 | Expand to the length of the first argument.  |
 `---------------------------------------------*/
@@ -1739,7 +2068,10 @@ m4_len (struct obstack *obs, int argc, token_data **argv)
 {
   if (bad_argc (argv[0], argc, 2, 2))
     return;
-  shipout_int (obs, strlen (ARG (1)));
+  if (utf8_mode)
+    shipout_int (obs, utf8_count (ARG (1), strlen (ARG (1))));
+  else
+    shipout_int (obs, strlen (ARG (1)));
 }
 
 /*-------------------------------------------------------------------.
@@ -1765,6 +2097,8 @@ m4_index (struct obstack *obs, int argc, token_data **argv)
   haystack = ARG (1);
   result = strstr (haystack, ARG (2));
   retval = result ? result - haystack : -1;
+  if (utf8_mode && retval > 0)
+    retval = utf8_count (haystack, retval);
 
   shipout_int (obs, retval);
 }
@@ -1801,6 +2135,14 @@ m4_substr (struct obstack *obs, int argc, token_data **argv)
   if (start < 0 || length <= 0 || start >= avail)
     return;
 
+  if (utf8_mode)
+    {
+      const char *end = ARG (1) + avail;
+      const char *text = utf8_skip (ARG (1), end, start);
+      obstack_grow (obs, text, utf8_skip (text, end, length) - text);
+      return;
+    }
+
   if (start + length > avail)
     length = avail - start;
   obstack_grow (obs, ARG (1) + start, length);
@@ -1852,6 +2194,170 @@ expand_ranges (const char *s, struct obstack *obs)
   return (char *) obstack_finish (obs);
 }
 
+/*-------------------------------------------------------------------.
+| With --utf8, "translit" works on characters as soon as its second  |
+| or third argument holds a non-ASCII one; otherwise the byte maps   |
+| below give the same result.  expand_utf8_ranges () decodes S into  |
+| a new array of *COUNT characters, expanding ranges the same way as |
+| expand_ranges (), except that a byte outside any well formed       |
+| sequence is never the end of a range, and the mapping is a table   |
+| of pairs sorted by the character to replace, with a direct map for |
+| ASCII.                                                             |
+`-------------------------------------------------------------------*/
+
+struct translit_pair
+{
+  unsigned int from;            /* character to replace */
+  unsigned int to;              /* replacement, or UINT_MAX to delete */
+  size_t order;                 /* position in the second argument */
+};
+
+static int
+translit_pair_cmp (const void *a, const void *b)
+{
+  const struct translit_pair *x = (const struct translit_pair *) a;
+  const struct translit_pair *y = (const struct translit_pair *) b;
+
+  if (x->from != y->from)
+    return x->from < y->from ? -1 : 1;
+  return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int
+translit_pair_find (const void *key, const void *elt)
+{
+  unsigned int wc = *(const unsigned int *) key;
+  const struct translit_pair *pair = (const struct translit_pair *) elt;
+
+  return wc < pair->from ? -1 : wc > pair->from;
+}
+
+static unsigned int *
+expand_utf8_ranges (const char *s, size_t *count)
+{
+  const char *end = s + strlen (s);
+  unsigned int *result = NULL;
+  size_t alloc = 0;
+  size_t n = 0;
+  size_t length;
+  unsigned int from = 0;
+  unsigned int to;
+  bool have_from = false;
+
+#define APPEND(Wc)                                                      \
+  do                                                                    \
+    {                                                                   \
+      if (n == alloc)                                                   \
+        result = x2nrealloc (result, &alloc, sizeof *result);           \
+      result[n++] = (Wc);                                               \
+    }                                                                   \
+  while (0)
+
+  while (s < end)
+    {
+      if (*s == '-' && have_from)
+        {
+          if (s + 1 == end)
+            {
+              /* trailing dash */
+              APPEND ('-');
+              break;
+            }
+          to = utf8_decode (s + 1, end, &length);
+          s += 1 + length;
+          if (from >= UTF8_BAD_BYTE || to >= UTF8_BAD_BYTE)
+            {
+              /* A stray byte does not delimit a range; keep the dash
+                 and the byte as they are.  */
+              APPEND ('-');
+              APPEND (to);
+              from = to;
+              continue;
+            }
+          while (from < to)
+            if (++from < 0xD800 || from > 0xDFFF)
+              APPEND (from);
+          while (from > to)
+            if (--from < 0xD800 || from > 0xDFFF)
+              APPEND (from);
+        }
+      else
+        {
+          from = utf8_decode (s, end, &length);
+          s += length;
+          have_from = true;
+          APPEND (from);
+        }
+    }
+
+#undef APPEND
+
+  *count = n;
+  return result;
+}
+
+static void
+utf8_translit (struct obstack *obs, const char *data, const char *from_arg,
+               const char *to_arg)
+{
+  const char *end = data + strlen (data);
+  unsigned int ascii_map[0x80];
+  struct translit_pair *pairs;
+  struct translit_pair *pair;
+  unsigned int *from;
+  unsigned int *to;
+  unsigned int wc;
+  size_t from_count;
+  size_t to_count;
+  size_t count;
+  size_t length;
+  size_t i;
+
+  from = expand_utf8_ranges (from_arg, &from_count);
+  to = expand_utf8_ranges (to_arg, &to_count);
+  pairs = xnmalloc (from_count, sizeof *pairs);
+  for (i = 0; i < from_count; i++)
+    {
+      pairs[i].from = from[i];
+      pairs[i].to = i < to_count ? to[i] : UINT_MAX;
+      pairs[i].order = i;
+    }
+  free (from);
+  free (to);
+
+  /* Only the first instance of a character in from is consulted.  */
+  qsort (pairs, from_count, sizeof *pairs, translit_pair_cmp);
+  for (i = count = 0; i < from_count; i++)
+    if (count == 0 || pairs[i].from != pairs[count - 1].from)
+      pairs[count++] = pairs[i];
+
+  for (wc = 0; wc < 0x80; wc++)
+    ascii_map[wc] = wc;
+  for (i = 0; i < count && pairs[i].from < 0x80; i++)
+    ascii_map[pairs[i].from] = pairs[i].to;
+
+  while (data < end)
+    {
+      if (to_uchar (*data) < 0x80)
+        {
+          wc = ascii_map[to_uchar (*data++)];
+          if (wc != UINT_MAX)
+            utf8_grow (obs, wc);
+          continue;
+        }
+      wc = utf8_decode (data, end, &length);
+      pair = (struct translit_pair *) bsearch (&wc, pairs, count,
+                                               sizeof *pairs,
+                                               translit_pair_find);
+      if (pair == NULL)
+        obstack_grow (obs, data, length);
+      else if (pair->to != UINT_MAX)
+        utf8_grow (obs, pair->to);
+      data += length;
+    }
+  free (pairs);
+}
+
 /*-----------------------------------------------------------------.
 | The macro "translit" translates all characters in the first      |
 | argument, which are present in the second argument, into the     |
@@ -1879,6 +2385,14 @@ m4_translit (struct obstack *obs, int argc, token_data **argv)
     }
 
   to = ARG (3);
+  if (utf8_mode
+      && (ascii_prefix (from, strlen (from)) != strlen (from)
+          || ascii_prefix (to, strlen (to)) != strlen (to)))
+    {
+      utf8_translit (obs, data, from, to);
+      return;
+    }
+
   if (strchr (to, '-') != NULL)
     {
       to = expand_ranges (to, obs);
@@ -2075,6 +2589,7 @@ m4_regexp (struct obstack *obs, int argc, token_data **argv)
   regexp = TOKEN_DATA_TEXT (argv[2]);
 
   init_pattern_buffer (&buf, &regs);
+  regex_compile_count++;
   msg = re_compile_pattern (regexp, strlen (regexp), &buf);
 
   if (msg != NULL)
@@ -2135,6 +2650,7 @@ m4_patsubst (struct obstack *obs, int argc, token_data **argv)
   regexp = TOKEN_DATA_TEXT (argv[2]);
 
   init_pattern_buffer (&buf, &regs);
+  regex_compile_count++;
   msg = re_compile_pattern (regexp, strlen (regexp), &buf);
 
   if (msg != NULL)
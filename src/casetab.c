@@ -0,0 +1,226 @@
+/* GNU m4 -- A simple macro processor
+
+   Copyright (C) 2023 Free Software Foundation, Inc.
+
+   This file is part of GNU M4.
+
+   GNU M4 is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   GNU M4 is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Named case tables, for the builtins casetable and caseof.  A case
+   table maps strings to expansions through a hash table built once,
+   so that a lookup costs the same however many cases there are.  */
+
+#include "m4.h"
+
+typedef struct case_entry case_entry;
+typedef struct case_table case_table;
+
+struct case_entry
+{
+  case_entry *next;             /* bucket chain */
+  size_t hash;
+  const char *key;
+  const char *value;
+};
+
+struct case_table
+{
+  case_table *next;             /* bucket chain of table_buckets */
+  size_t hash;
+  const char *name;
+  const char *fallback;         /* expansion of unknown keys, or NULL */
+  size_t size;                  /* number of buckets */
+  case_entry **buckets;
+  struct obstack memory;        /* name, entries, keys and values */
+};
+
+/* The tables themselves are found through a small hash table of their
+   own.  */
+#define TABLE_BUCKETS 61
+
+static case_table *table_buckets[TABLE_BUCKETS];
+static size_t table_count;
+
+/* Statistics for --stats.  */
+static uintmax_t case_lookup_count;
+static uintmax_t case_probe_count;
+
+/*--------------------------------------------------.
+| Return a hashvalue for a string, as in symtab.c.  |
+`--------------------------------------------------*/
+
+static size_t
+case_hash (const char *s)
+{
+  size_t val = 0;
+  unsigned char ch;
+
+  while ((ch = to_uchar (*s++)) != '\0')
+    val = (val << 7) + (val >> (sizeof (val) * CHAR_BIT - 7)) + ch;
+  return val;
+}
+
+/*-------------------------------------------------------------------.
+| Find the case table called NAME, and return the link that points   |
+| to it, or to where it would go if there is none.  Its hash is left |
+| in *HASH.                                                          |
+`-------------------------------------------------------------------*/
+
+static case_table **
+find_case_table (const char *name, size_t *hash)
+{
+  case_table **tpp;
+
+  *hash = case_hash (name);
+  for (tpp = &table_buckets[*hash % TABLE_BUCKETS]; *tpp != NULL;
+       tpp = &(*tpp)->next)
+    if ((*tpp)->hash == *hash && STREQ ((*tpp)->name, name))
+      break;
+  return tpp;
+}
+
+/*-------------------------------------------------------------------.
+| Define the case table NAME from the ARGC arguments in ARGV, taken  |
+| as pairs of a key and its expansion, with an odd one at the end    |
+| being the expansion of any other key.  The first of several equal  |
+| keys wins, as it would with ifelse.  An existing table of the same |
+| name is replaced; with no arguments, it is only removed.           |
+`-------------------------------------------------------------------*/
+
+void
+define_case_table (const char *name, int argc, token_data **argv)
+{
+  case_table **tpp;
+  case_table *table;
+  case_entry *entry;
+  case_entry **epp;
+  size_t hash;
+  int i;
+
+  tpp = find_case_table (name, &hash);
+  table = *tpp;
+  if (table != NULL)
+    {
+      *tpp = table->next;
+      obstack_free (&table->memory, NULL);
+      free (table);
+      table_count--;
+    }
+  if (argc == 0)
+    return;
+
+  table = (case_table *) xmalloc (sizeof *table);
+  obstack_init (&table->memory);
+  table->hash = hash;
+  table->name = obstack_copy0 (&table->memory, name, strlen (name));
+  table->fallback = NULL;
+  if (argc % 2)
+    {
+      const char *fallback = TOKEN_DATA_TEXT (argv[argc - 1]);
+      table->fallback = obstack_copy0 (&table->memory, fallback,
+                                       strlen (fallback));
+    }
+
+  /* An odd number of buckets keeps the modulus from ignoring the high
+     bits of the hash.  */
+  table->size = argc / 2 * 2 + 1;
+  table->buckets = (case_entry **) obstack_alloc (&table->memory,
+                                                  (table->size
+                                                   * sizeof (case_entry *)));
+  memset (table->buckets, 0, table->size * sizeof (case_entry *));
+
+  for (i = 0; i + 1 < argc; i += 2)
+    {
+      const char *key = TOKEN_DATA_TEXT (argv[i]);
+      const char *value = TOKEN_DATA_TEXT (argv[i + 1]);
+
+      hash = case_hash (key);
+      for (epp = &table->buckets[hash % table->size]; *epp != NULL;
+           epp = &(*epp)->next)
+        if ((*epp)->hash == hash && STREQ ((*epp)->key, key))
+          break;
+      if (*epp != NULL)
+        continue;
+
+      entry = (case_entry *) obstack_alloc (&table->memory, sizeof *entry);
+      entry->next = NULL;
+      entry->hash = hash;
+      entry->key = obstack_copy0 (&table->memory, key, strlen (key));
+      entry->value = obstack_copy0 (&table->memory, value, strlen (value));
+      *epp = entry;
+    }
+
+  table->next = table_buckets[table->hash % TABLE_BUCKETS];
+  table_buckets[table->hash % TABLE_BUCKETS] = table;
+  table_count++;
+}
+
+/* Return true if any case table is defined.  */
+
+bool
+case_tables_defined (void)
+{
+  return table_count != 0;
+}
+
+/*------------------------------------------------------------------.
+| Add to OBS the expansion of KEY in the case table NAME.  A key    |
+| not in the table gets the fallback expansion, if any.             |
+`------------------------------------------------------------------*/
+
+void
+expand_case (struct obstack *obs, const char *name, const char *key)
+{
+  case_table *table;
+  case_entry *entry;
+  const char *result;
+  size_t hash;
+
+  table = *find_case_table (name, &hash);
+  if (table == NULL)
+    {
+      M4ERROR ((warning_status, 0, _("undefined case table `%s'"), name));
+      return;
+    }
+
+  case_lookup_count++;
+  hash = case_hash (key);
+  result = table->fallback;
+  for (entry = table->buckets[hash % table->size]; entry != NULL;
+       entry = entry->next)
+    {
+      case_probe_count++;
+      if (entry->hash == hash && STREQ (entry->key, key))
+        {
+          result = entry->value;
+          break;
+        }
+    }
+
+  if (result != NULL)
+    obstack_grow (obs, result, strlen (result));
+}
+
+/*-------------------------------------------.
+| Print case table statistics, for --stats.  |
+`-------------------------------------------*/
+
+void
+case_print_stats (void)
+{
+  if (case_lookup_count)
+    stats_message ("case tables: %ju lookups, %ju probes",
+                   case_lookup_count, case_probe_count);
+}
@@ -24,6 +24,8 @@
 #include <stdarg.h>
 #include <sys/stat.h>
 
+#include "gethrxtime.h"
+
 /* File for debugging output.  */
 FILE *debug = NULL;
 
@@ -236,7 +238,267 @@ debug_message_prefix (void)
   }
   putc (' ', debug);
 }
+
+/*---------------------------------------------------------------.
+| Print one line of runtime statistics to stderr, for --stats.   |
+`---------------------------------------------------------------*/
+
+void
+stats_message (const char *format, ...)
+{
+  va_list args;
+
+  xfprintf (stderr, "m4stats: ");
+  va_start (args, format);
+  xvfprintf (stderr, format, args);
+  va_end (args);
+  putc ('\n', stderr);
+}
 
+/* With --trace-log, tracing output is written as binary records
+   instead of text.  Records are cheap to produce: no formatting,
+   and macro and file names are written once and then referred to by
+   number.  m4 --trace-decode turns a log back into the text that
+   would have been printed.
+
+   A log starts with the 8 bytes "M4TRACE1", a 32-bit 0x01020304 to
+   identify the byte order, and the 32-bit -l limit.  It is followed
+   by records, each a struct trace_record in host byte order and
+   possibly some payload items.  A payload item is a struct
+   trace_item followed by STORED bytes of text, where LENGTH is the
+   original length (TRACE_ITEM_BUILTIN for the name of a builtin
+   passed as an argument).  When -l is in effect, only the first
+   (limit + 1) bytes of a text are kept.  */
+
+enum trace_record_type
+{
+  TRACE_STRING = 'S',           /* ID names string COUNT bytes long */
+  TRACE_QUOTES = 'Q',           /* two items: the quotes */
+  TRACE_PREPRE = 'B',           /* before argument collection */
+  TRACE_PRE = 'A',              /* after collection, COUNT arguments */
+  TRACE_POST = 'E'              /* after expansion, COUNT is 0 or 1 */
+};
+
+struct trace_record
+{
+  uint8_t type;                 /* enum trace_record_type */
+  uint8_t argc_gt_1;            /* true if the call had arguments */
+  uint8_t unused[2];
+  int32_t id;                   /* macro call id, or string id */
+  int32_t name;                 /* string id of the macro name */
+  int32_t level;                /* expansion_level */
+  int32_t file;                 /* string id of current_file */
+  int32_t line;                 /* current_line */
+  int32_t debug_level;          /* debug_level */
+  int32_t count;                /* number of payload items */
+  uint64_t time;                /* nanoseconds since the log started */
+};
+
+struct trace_item
+{
+  uint32_t length;              /* original length of the text */
+  uint32_t stored;              /* bytes of text that follow */
+};
+
+#define TRACE_ITEM_BUILTIN UINT32_MAX
+#define TRACE_LOG_MAGIC "M4TRACE1"
+
+typedef struct trace_record trace_record;
+typedef struct trace_item trace_item;
+
+/* Binary trace log, or NULL.  */
+static FILE *trace_log;
+
+/* Time when trace_log was opened.  */
+static xtime_t trace_log_start;
+
+/* Ids that the names already written to trace_log were given in the
+   log, plus one, indexed by their interned name id (see symtab.c).  */
+static int32_t *trace_names;
+static size_t trace_names_size;
+static int32_t trace_names_count;
+
+/* The interned empty name, which stands for an empty current_file.  */
+static char *trace_empty_name;
+
+/* Quotes last written to trace_log.  */
+static char *trace_lquote;
+static char *trace_rquote;
+
+/* Write LENGTH bytes at DATA to trace_log.  */
+static void
+trace_log_write (const void *data, size_t length)
+{
+  if (length && fwrite (data, length, 1, trace_log) != 1)
+    m4_failure (errno, _("error writing to trace log"));
+}
+
+/* Write TEXT to trace_log as a payload item, truncated according to
+   -l.  */
+static void
+trace_log_item (const char *text)
+{
+  trace_item item;
+  size_t length = strlen (text);
+
+  item.length = length;
+  item.stored = length;
+  if (max_debug_argument_length > 0
+      && length > (size_t) max_debug_argument_length)
+    item.stored = max_debug_argument_length + 1;
+  trace_log_write (&item, sizeof item);
+  trace_log_write (text, item.stored);
+}
+
+/* Return the log id of NAME, which is interned or empty, writing a
+   TRACE_STRING record the first time it is seen.  */
+static int32_t
+trace_log_string (const char *name)
+{
+  size_t id;
+  trace_record record;
+
+  if (*name == '\0')
+    name = trace_empty_name;
+  id = name_id (name);
+  if (id >= trace_names_size)
+    {
+      size_t old_size = trace_names_size;
+
+      trace_names_size = id < 64 ? 128 : id * 2;
+      trace_names = xnrealloc (trace_names, trace_names_size,
+                               sizeof *trace_names);
+      memset (trace_names + old_size, 0,
+              (trace_names_size - old_size) * sizeof *trace_names);
+    }
+  if (trace_names[id] != 0)
+    return trace_names[id] - 1;
+
+  memset (&record, 0, sizeof record);
+  record.type = TRACE_STRING;
+  record.id = trace_names_count++;
+  record.count = strlen (name);
+  trace_log_write (&record, sizeof record);
+  trace_log_write (name, record.count);
+  trace_names[id] = record.id + 1;
+  return record.id;
+}
+
+/*-------------------------------------------------------------------.
+| Start a trace record of TYPE for macro NAME and call ID, with      |
+| COUNT payload items to follow.  If the quotes are part of the      |
+| output and changed since the last record, log them first.          |
+`-------------------------------------------------------------------*/
+
+static void
+trace_log_record (enum trace_record_type type, const char *name, int id,
+                  int argc, int count)
+{
+  trace_record record;
+
+  if ((debug_level & DEBUG_TRACE_QUOTE)
+      && (!trace_lquote || !STREQ (trace_lquote, lquote.string)
+          || !STREQ (trace_rquote, rquote.string)))
+    {
+      free (trace_lquote);
+      free (trace_rquote);
+      trace_lquote = xstrdup (lquote.string);
+      trace_rquote = xstrdup (rquote.string);
+      memset (&record, 0, sizeof record);
+      record.type = TRACE_QUOTES;
+      record.count = 2;
+      trace_log_write (&record, sizeof record);
+      trace_log_item (trace_lquote);
+      trace_log_item (trace_rquote);
+    }
+
+  memset (&record, 0, sizeof record);
+  record.type = type;
+  record.argc_gt_1 = argc > 1;
+  record.id = id;
+  record.name = trace_log_string (name);
+  record.level = expansion_level;
+  record.file = trace_log_string (current_file);
+  record.line = current_line;
+  record.debug_level = debug_level;
+  record.count = count;
+  record.time = gethrxtime () - trace_log_start;
+  trace_log_write (&record, sizeof record);
+}
+
+/* Log the arguments of a call to macro NAME with call ID, where ARGC
+   and ARGV are as for trace_pre.  */
+static void
+trace_log_pre (const char *name, int id, int argc, token_data **argv)
+{
+  int count = (debug_level & DEBUG_TRACE_ARGS) ? argc - 1 : 0;
+  int i;
+
+  trace_log_record (TRACE_PRE, name, id, argc, count);
+  for (i = 1; i <= count; i++)
+    if (TOKEN_DATA_TYPE (argv[i]) == TOKEN_FUNC)
+      {
+        const builtin *bp = find_builtin_by_addr (TOKEN_DATA_FUNC (argv[i]));
+        trace_item item;
+
+        assert (bp != NULL);
+        item.length = TRACE_ITEM_BUILTIN;
+        item.stored = strlen (bp->name);
+        trace_log_write (&item, sizeof item);
+        trace_log_write (bp->name, item.stored);
+      }
+    else
+      trace_log_item (TOKEN_DATA_TEXT (argv[i]));
+}
+
+/*------------------------------------------------------------------.
+| Send all further tracing output to file NAME, in binary.  Return  |
+| false, with errno set, if the file cannot be created.             |
+`------------------------------------------------------------------*/
+
+bool
+trace_log_open (const char *name)
+{
+  uint32_t header[2];
+
+  trace_log = fopen (name, "wbe");
+  if (trace_log == NULL)
+    return false;
+  trace_log_start = gethrxtime ();
+  trace_empty_name = intern_name ("");
+  header[0] = 0x01020304;
+  header[1] = max_debug_argument_length;
+  trace_log_write (TRACE_LOG_MAGIC, 8);
+  trace_log_write (header, sizeof header);
+  return true;
+}
+
+/*---------------------------------------------------------.
+| Finish the binary trace log, if any, reporting failure.  |
+`---------------------------------------------------------*/
+
+void
+trace_log_close (void)
+{
+  if (trace_log == NULL)
+    return;
+  if (close_stream (trace_log) != 0)
+    {
+      M4ERROR ((warning_status, errno, _("error writing to trace log")));
+      retcode = EXIT_FAILURE;
+    }
+  trace_log = NULL;
+  release_name (trace_empty_name);
+  free (trace_names);
+  free (trace_lquote);
+  free (trace_rquote);
+}
+
+/* While trace_decode () runs, the quotes recorded in the log, which
+   trace_format () shows instead of the current ones.  */
+static const char *decoded_lquote;
+static const char *decoded_rquote;
+
 /* The rest of this file contains the functions for macro tracing output.
    All tracing output for a macro call is collected on an obstack TRACE,
    and printed whenever the line is complete.  This prevents tracing
@@ -281,11 +543,13 @@ trace_format (const char *fmt, ...)
           break;
 
         case 'l':
-          s = (debug_level & DEBUG_TRACE_QUOTE) ? lquote.string : "";
+          s = ((debug_level & DEBUG_TRACE_QUOTE) == 0 ? ""
+               : decoded_lquote ? decoded_lquote : lquote.string);
           break;
 
         case 'r':
-          s = (debug_level & DEBUG_TRACE_QUOTE) ? rquote.string : "";
+          s = ((debug_level & DEBUG_TRACE_QUOTE) == 0 ? ""
+               : decoded_rquote ? decoded_rquote : rquote.string);
           break;
 
         case 'd':
@@ -354,6 +618,11 @@ trace_flush (void)
 void
 trace_prepre (const char *name, int id)
 {
+  if (trace_log)
+    {
+      trace_log_record (TRACE_PREPRE, name, id, 0, 0);
+      return;
+    }
   trace_header (id);
   trace_format ("%s ...", name);
   trace_flush ();
@@ -370,6 +639,11 @@ trace_pre (const char *name, int id, int argc, token_data **argv)
   int i;
   const builtin *bp;
 
+  if (trace_log)
+    {
+      trace_log_pre (name, id, argc, argv);
+      return;
+    }
   trace_header (id);
   trace_format ("%s", name);
 
@@ -425,6 +699,14 @@ INTERNAL ERROR: builtin not found in builtin table! (trace_pre ())"));
 void
 trace_post (const char *name, int id, int argc, const char *expanded)
 {
+  if (trace_log)
+    {
+      bool shown = expanded && (debug_level & DEBUG_TRACE_EXPANSION);
+      trace_log_record (TRACE_POST, name, id, argc, shown);
+      if (shown)
+        trace_log_item (expanded);
+      return;
+    }
   if (debug_level & DEBUG_TRACE_CALL)
     {
       trace_header (id);
@@ -435,3 +717,176 @@ trace_post (const char *name, int id, int argc, const char *expanded)
     trace_format (" -> %l%S%r", expanded);
   trace_flush ();
 }
+
+/* Read LENGTH bytes from FP into DATA, or fail with a message about
+   log NAME.  */
+static void
+trace_decode_read (FILE *fp, const char *name, void *data, size_t length)
+{
+  if (length && fread (data, length, 1, fp) != 1)
+    m4_failure (ferror (fp) ? errno : 0, _("cannot read trace log `%s'"),
+                name);
+}
+
+/* Read a payload item from FP into obstack OBS, and return it as a
+   NUL-terminated string.  Set *BUILTIN if it names a builtin.  */
+static char *
+trace_decode_item (FILE *fp, const char *name, struct obstack *obs,
+                   bool *builtin)
+{
+  trace_item item;
+
+  trace_decode_read (fp, name, &item, sizeof item);
+  *builtin = item.length == TRACE_ITEM_BUILTIN;
+  obstack_blank (obs, item.stored);
+  trace_decode_read (fp, name, (char *) obstack_next_free (obs) - item.stored,
+                     item.stored);
+  obstack_1grow (obs, '\0');
+  return (char *) obstack_finish (obs);
+}
+
+/*-------------------------------------------------------------------.
+| Read the binary trace log NAME, and print it on standard output as |
+| the text tracing would have produced.  Return the exit status.     |
+`-------------------------------------------------------------------*/
+
+int
+trace_decode (const char *name)
+{
+  FILE *fp;
+  char magic[8];
+  uint32_t header[2];
+  trace_record record;
+  struct obstack strings;
+  struct obstack items;
+  char **table = NULL;
+  size_t table_size = 0;
+  char *lquote_text = xstrdup (DEF_LQUOTE);
+  char *rquote_text = xstrdup (DEF_RQUOTE);
+  bool builtin;
+  int c;
+
+  fp = STREQ (name, "-") ? stdin : fopen (name, "rbe");
+  if (fp == NULL)
+    m4_failure (errno, _("cannot open trace log `%s'"), name);
+  trace_decode_read (fp, name, magic, sizeof magic);
+  trace_decode_read (fp, name, header, sizeof header);
+  if (memcmp (magic, TRACE_LOG_MAGIC, sizeof magic) != 0
+      || header[0] != 0x01020304)
+    m4_failure (0, _("`%s' is not a trace log for this machine"), name);
+  max_debug_argument_length = header[1];
+
+  debug_set_file (stdout);
+  decoded_lquote = lquote_text;
+  decoded_rquote = rquote_text;
+  obstack_init (&strings);
+  obstack_init (&items);
+  while ((c = getc (fp)) != EOF)
+    {
+      const char *macro = NULL;
+      token_data *args = NULL;
+      token_data **argv = NULL;
+      char *expanded = NULL;
+      void *mark;
+      int i;
+
+      ungetc (c, fp);
+      trace_decode_read (fp, name, &record, sizeof record);
+      if (record.type == TRACE_STRING)
+        {
+          if (record.id < 0 || record.count < 0
+              || (size_t) record.id != table_size)
+            m4_failure (0, _("corrupt trace log `%s'"), name);
+          table = xnrealloc (table, ++table_size, sizeof *table);
+          obstack_blank (&strings, record.count);
+          trace_decode_read (fp, name,
+                             (char *) obstack_next_free (&strings)
+                             - record.count, record.count);
+          obstack_1grow (&strings, '\0');
+          table[record.id] = (char *) obstack_finish (&strings);
+          continue;
+        }
+      if (record.type == TRACE_QUOTES)
+        {
+          char *lq = trace_decode_item (fp, name, &items, &builtin);
+          char *rq = trace_decode_item (fp, name, &items, &builtin);
+          free (lquote_text);
+          free (rquote_text);
+          decoded_lquote = lquote_text = xstrdup (lq);
+          decoded_rquote = rquote_text = xstrdup (rq);
+          obstack_free (&items, lq);
+          continue;
+        }
+
+      if (record.name < 0 || (size_t) record.name >= table_size
+          || record.file < 0 || (size_t) record.file >= table_size
+          || record.count < 0)
+        m4_failure (0, _("corrupt trace log `%s'"), name);
+      macro = table[record.name];
+      current_file = table[record.file];
+      current_line = record.line;
+      expansion_level = record.level;
+      debug_level = record.debug_level;
+
+      switch (record.type)
+        {
+        case TRACE_PREPRE:
+          trace_prepre (macro, record.id);
+          break;
+
+        case TRACE_PRE:
+          mark = obstack_finish (&items);
+          args = xnmalloc (record.count + 1, sizeof *args);
+          argv = xnmalloc (record.count + 1, sizeof *argv);
+          for (i = 0; i <= record.count; i++)
+            argv[i] = &args[i];
+          TOKEN_DATA_TYPE (&args[0]) = TOKEN_TEXT;
+          TOKEN_DATA_TEXT (&args[0]) = (char *) macro;
+          for (i = 1; i <= record.count; i++)
+            {
+              char *text = trace_decode_item (fp, name, &items, &builtin);
+              if (builtin)
+                {
+                  TOKEN_DATA_TYPE (&args[i]) = TOKEN_FUNC;
+                  TOKEN_DATA_FUNC (&args[i])
+                    = find_builtin_by_name (text)->func;
+                }
+              else
+                {
+                  TOKEN_DATA_TYPE (&args[i]) = TOKEN_TEXT;
+                  TOKEN_DATA_TEXT (&args[i]) = text;
+                }
+            }
+          /* Arguments are only logged when they are shown, but the
+             text format still needs to know that there were some.  */
+          trace_pre (macro, record.id,
+                     record.count ? record.count + 1 : record.argc_gt_1 + 1,
+                     argv);
+          free (argv);
+          free (args);
+          obstack_free (&items, mark);
+          break;
+
+        case TRACE_POST:
+          if (record.count)
+            expanded = trace_decode_item (fp, name, &items, &builtin);
+          trace_post (macro, record.id, record.argc_gt_1 + 1, expanded);
+          if (expanded)
+            obstack_free (&items, expanded);
+          break;
+
+        default:
+          m4_failure (0, _("corrupt trace log `%s'"), name);
+        }
+    }
+
+  if (fp != stdin)
+    fclose (fp);
+  obstack_free (&items, NULL);
+  obstack_free (&strings, NULL);
+  free (table);
+  decoded_lquote = decoded_rquote = NULL;
+  free (lquote_text);
+  free (rquote_text);
+  return EXIT_SUCCESS;
+}
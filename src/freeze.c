@@ -23,6 +23,12 @@
 
 #include "m4.h"
 
+#include "gethrxtime.h"
+
+/* Time spent reloading the frozen file, for --stats.  */
+static bool reloaded;
+static xtime_t reload_time;
+
 /*-------------------------------------------------------------------.
 | Destructively reverse a symbol list and return the reversed list.  |
 `-------------------------------------------------------------------*/
@@ -144,6 +150,12 @@ produce_frozen_state (const char *name)
 
   hack_all_symbols (freeze_symbol, file);
 
+  /* The format has no room for case tables, so they are lost.  */
+
+  if (case_tables_defined ())
+    M4ERROR ((warning_status, 0,
+              _("Warning: case tables are not saved in frozen state")));
+
   /* Let diversions be issued from output.c module, its cleaner to have this
      piece of code there.  */
 
@@ -186,6 +198,7 @@ reload_frozen_state (const char *name)
   int number[2];
   const builtin *bp;
   bool advance_line = true;
+  xtime_t start = gethrxtime ();
 
 #define GET_CHARACTER                                           \
   do                                                            \
@@ -385,6 +398,8 @@ reload_frozen_state (const char *name)
     m4_failure (errno, _("unable to read frozen state"));
   current_file = NULL;
   current_line = 0;
+  reload_time = gethrxtime () - start;
+  reloaded = true;
 
 #undef GET_CHARACTER
 #undef GET_DIRECTIVE
@@ -392,3 +407,15 @@ reload_frozen_state (const char *name)
 #undef VALIDATE
 #undef GET_STRING
 }
+
+/*---------------------------------------------.
+| Print frozen file statistics, for --stats.   |
+`---------------------------------------------*/
+
+void
+freeze_print_stats (void)
+{
+  if (reloaded)
+    stats_message ("frozen: state reloaded in %.6fs",
+                   (double) reload_time / XTIME_PRECISION);
+}
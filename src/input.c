@@ -23,6 +23,8 @@
 
 #include "m4.h"
 
+#include <wctype.h>
+
 #include "memchr2.h"
 
 /* Unread input can be either files, that should be read (eg. included
@@ -79,20 +81,25 @@ struct input_block
   input_type type;              /* see enum values */
   const char *file;             /* file where this input is from */
   int line;                     /* line where this input is from */
+  char *string;                 /* remaining text, or empty_text */
+  char *end;                    /* terminating NUL of text */
   union
     {
       struct
         {
-          char *string;         /* remaining string value */
-          char *end;            /* terminating NUL of string */
+          char *text;           /* start of storage, freed on pop */
         }
         u_s;    /* INPUT_STRING */
       struct
         {
           FILE *fp;                  /* input file handle */
+          char *buffer;              /* read buffer, freed on pop */
+          char *mark;                /* end of text counted in line */
           bool_bitfield end : 1;     /* true if peek has seen EOF */
           bool_bitfield close : 1;   /* true if we should close file on pop */
           bool_bitfield advance : 1; /* track previous start_of_input_line */
+          bool_bitfield newline : 1; /* last byte counted was a newline */
+          bool_bitfield error : 1;   /* true if reading the buffer failed */
         }
         u_f;    /* INPUT_FILE */
       builtin_func *func;       /* pointer to macro's function */
@@ -103,7 +110,7 @@ struct input_block
 typedef struct input_block input_block;
 
 
-/* Current input file name.  */
+/* Current input file name, interned unless empty.  */
 const char *current_file;
 
 /* Current input line number.  */
@@ -112,15 +119,23 @@ int current_line;
 /* Obstack for storing individual tokens.  */
 static struct obstack token_stack;
 
-/* Obstack for storing file names.  */
-static struct obstack file_names;
-
 /* Wrapup input stack.  */
 static struct obstack *wrapup_stack;
 
 /* Current stack, from input or wrapup.  */
 static struct obstack *current_input;
 
+/* Statistics for --stats.  Peak sizes of the input stacks are
+   sampled whenever they grow a new chunk.  */
+static uintmax_t token_count[TOKEN_MACDEF + 1];
+static uintmax_t pushback_count;
+static uintmax_t pushback_bytes;
+static uintmax_t inert_count;
+static uintmax_t inert_bytes;
+static size_t token_peak;
+static size_t input_peak;
+static void *input_chunk;
+
 /* Bottom of token_stack, for obstack_free.  */
 static void *token_bottom;
 
@@ -133,12 +148,64 @@ static input_block *wsp;
 /* Aux. for handling split push_string ().  */
 static input_block *next;
 
+/* Set when push_string_inert () has handed out the text of next, which
+   push_string_finish () then discards rather than pushes.  */
+static bool next_inert;
+
 /* Flag for next_char () to increment current_line.  */
 static bool start_of_input_line;
 
 /* Flag for next_char () to recognize change in input block.  */
 static bool input_change;
 
+/* Set when peek_token () has already read an open parenthesis, which
+   next_token () then returns without looking at the input again.  Its
+   callers always read the parenthesis right after peeking at it, so
+   no other reader of the input can come in between.  */
+static bool open_pending;
+static int open_line;
+
+/* Set while the last token returned by next_token () points into an
+   input block, which pushing or popping input may release or
+   overwrite.  Its consumer must be done with it before either.  */
+static bool token_view;
+
+/* Input blocks are kept apart from the text of the input stacks, and
+   are recycled through a free list rather than freed.  The chunks of
+   current_input and wrapup_stack, the segments, are recycled as well,
+   up to INPUT_SEGMENT_CACHE bytes of them, so that pushing and popping
+   expansions across a chunk boundary does not go back to malloc.  */
+union input_segment
+{
+  struct
+    {
+      union input_segment *next;        /* next free segment */
+      size_t size;                      /* usable bytes after header */
+    }
+  s;
+  long double align_ld;                 /* for alignment only */
+  uintmax_t align_int;
+  void *align_ptr;
+};
+
+#define INPUT_SEGMENT_CACHE (256 * 1024)
+
+static input_block *free_blocks;
+static union input_segment *free_segments;
+static size_t free_segment_bytes;
+
+/* Statistics for --stats.  */
+static uintmax_t block_count;
+static uintmax_t block_reuse_count;
+static uintmax_t segment_count;
+static uintmax_t segment_reuse_count;
+
+/* Size of the read buffer for input files other than stdin.  */
+#define INPUT_BUFFER_SIZE (64 * 1024)
+
+/* Text of the blocks that are not read in place.  */
+static char empty_text[1];
+
 #define CHAR_EOF        256     /* character return on EOF */
 #define CHAR_MACRO      257     /* character return for MACRO token */
 
@@ -158,6 +225,47 @@ static struct re_pattern_buffer word_regexp;
 static int default_word_regexp;
 static struct re_registers regs;
 
+/* Nodes of a Thompson NFA for the word regexp, used by next_token ()
+   to grow a word one byte at a time.  A SET node consumes one byte
+   from its set, EPSILON and SPLIT nodes consume nothing, and reaching
+   the MATCH node means the word so far is entirely matched.  */
+enum word_node_type
+{
+  WORD_NODE_SET,
+  WORD_NODE_EPSILON,
+  WORD_NODE_SPLIT,
+  WORD_NODE_MATCH
+};
+
+struct word_node
+{
+  enum word_node_type type;
+  int next;                     /* successor, -1 while unpatched */
+  int next2;                    /* second successor of a SPLIT */
+  char *set;                    /* UCHAR_MAX + 1 flags for a SET */
+};
+
+/* A piece of NFA under construction: its entry, and an EPSILON node
+   whose successor is still to be patched.  */
+struct word_fragment
+{
+  int first;
+  int last;
+};
+
+/* The NFA, or NULL when the word regexp is beyond it.  */
+static struct word_node *word_nodes;
+static size_t word_node_count;
+static size_t word_node_alloc;
+static int word_start;
+
+/* State sets of the simulation, and marks to avoid duplicates.  */
+static int *word_states;
+static int *word_next_states;
+static int word_state_count;
+static unsigned int *word_marks;
+static unsigned int word_generation;
+
 #else /* ! ENABLE_CHANGEWORD */
 # define default_word_regexp 1
 #endif /* ! ENABLE_CHANGEWORD */
@@ -167,6 +275,123 @@ static const char *token_type_string (token_type);
 #endif
 
 static void pop_input (void);
+#ifdef ENABLE_CHANGEWORD
+static void free_word_nfa (void);
+#endif
+
+
+/*--------------------------------------------------------------------.
+| Allocate an input block, preferably one that was released earlier.  |
+`--------------------------------------------------------------------*/
+
+static input_block *
+alloc_block (void)
+{
+  input_block *block = free_blocks;
+
+  if (block != NULL)
+    {
+      free_blocks = block->prev;
+      block_reuse_count++;
+    }
+  else
+    {
+      block = (input_block *) xmalloc (sizeof *block);
+      block_count++;
+    }
+  return block;
+}
+
+static void
+free_block (input_block *block)
+{
+  block->prev = free_blocks;
+  free_blocks = block;
+}
+
+/*-------------------------------------------------------------------.
+| Chunk allocation functions for the input obstacks.  A request is   |
+| served by the smallest free segment that is large enough, if any.  |
+`-------------------------------------------------------------------*/
+
+static void *
+alloc_segment (size_t size)
+{
+  union input_segment **best = NULL;
+  union input_segment **p;
+  union input_segment *segment;
+
+  for (p = &free_segments; *p != NULL; p = &(*p)->s.next)
+    if ((*p)->s.size >= size
+        && (best == NULL || (*p)->s.size < (*best)->s.size))
+      best = p;
+
+  if (best != NULL)
+    {
+      segment = *best;
+      *best = segment->s.next;
+      free_segment_bytes -= segment->s.size;
+      segment_reuse_count++;
+    }
+  else
+    {
+      segment = (union input_segment *) xmalloc (sizeof *segment + size);
+      segment->s.size = size;
+      segment_count++;
+    }
+  return segment + 1;
+}
+
+static void
+free_segment (void *chunk)
+{
+  union input_segment *segment = (union input_segment *) chunk - 1;
+
+  if (free_segment_bytes + segment->s.size > INPUT_SEGMENT_CACHE)
+    {
+      free (segment);
+      return;
+    }
+  segment->s.next = free_segments;
+  free_segments = segment;
+  free_segment_bytes += segment->s.size;
+}
+
+static void
+init_input_obstack (struct obstack *obs)
+{
+  obstack_specify_allocation (obs, 0, 0, alloc_segment, free_segment);
+}
+
+/*--------------------------------------------------------------------.
+| Give up the string block prepared by push_string_init (), if any,   |
+| together with whatever text was already grown or finished for it.   |
+`--------------------------------------------------------------------*/
+
+static void
+discard_next (void)
+{
+  if (next != NULL)
+    {
+      obstack_free (current_input, next->u.u_s.text);
+      free_block (next);
+      next = NULL;
+      next_inert = false;
+    }
+}
+
+/*------------------------------------------------------------------.
+| Pop the string blocks on top of the input stack that have been    |
+| read in full, so that a block pushed now reuses their storage     |
+| instead of piling up above them, as in a tail call.               |
+`------------------------------------------------------------------*/
+
+static void
+pop_exhausted_strings (void)
+{
+  while (isp && isp->type == INPUT_STRING && !isp->string[0])
+    pop_input ();
+}
 
 
 
@@ -183,32 +408,119 @@ push_file (FILE *fp, const char *title, bool close_when_done)
 {
   input_block *i;
 
-  if (next != NULL)
-    {
-      obstack_free (current_input, next);
-      next = NULL;
-    }
+  discard_next ();
+  pop_exhausted_strings ();
 
   if (debug_level & DEBUG_TRACE_INPUT)
     DEBUG_MESSAGE1 ("input read from %s", title);
 
-  i = (input_block *) obstack_alloc (current_input,
-                                     sizeof (struct input_block));
+  i = alloc_block ();
   i->type = INPUT_FILE;
-  i->file = (char *) obstack_copy0 (&file_names, title, strlen (title));
+  /* The name is never released, as it may be used in messages for
+     as long as m4 runs.  Including a file repeatedly costs a single
+     copy of its name.  */
+  i->file = intern_name (title);
   i->line = 1;
   input_change = true;
 
+  /* Read named files in large chunks, which matters most on
+     networked file systems, into a buffer that the lexer scans in
+     place, as it does strings.  Standard input is left to stdio, one
+     byte at a time, since it may be shared with syscmd children or
+     already in use.  */
   i->u.u_f.fp = fp;
+  i->u.u_f.buffer = NULL;
+  i->string = i->end = empty_text;
+  if (close_when_done)
+    {
+      i->u.u_f.buffer = xcharalloc (INPUT_BUFFER_SIZE + 1);
+      i->string = i->end = i->u.u_f.mark = i->u.u_f.buffer;
+      *i->end = '\0';
+    }
   i->u.u_f.end = false;
   i->u.u_f.close = close_when_done;
   i->u.u_f.advance = start_of_input_line;
+  i->u.u_f.newline = false;
+  i->u.u_f.error = false;
   output_current_line = -1;
 
   i->prev = isp;
   isp = i;
 }
 
+/*-------------------------------------------------------------------.
+| A named file is read into the buffer of its block, and its bytes   |
+| are then taken from there in place, as from a string, without any  |
+| bookkeeping per byte.  Its line number is brought up to date only  |
+| when it is needed, or when other input is pushed on top of it, by  |
+| count_input_lines (), which counts the newlines read since its     |
+| last call.  A newline belongs to the line it ends, so the line     |
+| number only goes past it once a byte after it has been read.       |
+| Return the line number of BLOCK.                                   |
+`-------------------------------------------------------------------*/
+
+static int
+count_input_lines (input_block *block)
+{
+  const char *p;
+  const char *last;
+
+  if (block->type != INPUT_FILE || block->u.u_f.buffer == NULL
+      || block->string == block->u.u_f.mark)
+    return block->line;
+
+  p = block->u.u_f.mark;
+  last = block->string - 1;
+  if (block->u.u_f.newline)
+    block->line++;
+  while ((p = (char *) memchr (p, '\n', last - p)) != NULL)
+    {
+      block->line++;
+      p++;
+    }
+  block->u.u_f.newline = *last == '\n';
+  block->u.u_f.mark = block->string;
+  return block->line;
+}
+
+/* Bring current_line up to date, after bytes were read in place from
+   the file on top of the input stack.  */
+
+static void
+update_current_line (void)
+{
+  if (isp && isp->type == INPUT_FILE && !input_change)
+    current_line = count_input_lines (isp);
+}
+
+/* Read more of the file of BLOCK, once its buffer is used up.  Return
+   false at end of file.  Unlike stdio, this takes whatever a pipe or
+   terminal has ready, rather than wait for a full buffer.  */
+
+static bool
+fill_input_buffer (input_block *block)
+{
+  ssize_t length;
+
+  if (block->u.u_f.end)
+    return false;
+  count_input_lines (block);
+  do
+    length = read (fileno (block->u.u_f.fp), block->u.u_f.buffer,
+                   INPUT_BUFFER_SIZE);
+  while (length < 0 && errno == EINTR);
+  if (length <= 0)
+    {
+      block->u.u_f.end = true;
+      block->u.u_f.error = length < 0;
+      return false;
+    }
+  block->string = block->u.u_f.mark = block->u.u_f.buffer;
+  block->end = block->string + length;
+  *block->end = '\0';
+  return true;
+}
+
 /*---------------------------------------------------------------.
 | push_macro () pushes a builtin macro's definition on the input |
 | stack.  If next is non-NULL, this push invalidates a call to   |
@@ -220,17 +532,17 @@ push_macro (builtin_func *func)
 {
   input_block *i;
 
-  if (next != NULL)
-    {
-      obstack_free (current_input, next);
-      next = NULL;
-    }
+  assert (!token_view);
+  discard_next ();
+  pop_exhausted_strings ();
+  if (isp)
+    count_input_lines (isp);
 
-  i = (input_block *) obstack_alloc (current_input,
-                                     sizeof (struct input_block));
+  i = alloc_block ();
   i->type = INPUT_MACRO;
   i->file = current_file;
   i->line = current_line;
+  i->string = i->end = empty_text;
   input_change = true;
 
   i->u.func = func;
@@ -240,7 +552,8 @@ push_macro (builtin_func *func)
 
 /*------------------------------------------------------------------.
 | First half of push_string ().  The pointer next points to the new |
-| input_block.                                                      |
+| input_block.  Builtins may also finish scratch objects on the     |
+| returned obstack; they are released along with the block.         |
 `------------------------------------------------------------------*/
 
 struct obstack *
@@ -252,15 +565,20 @@ push_string_init (void)
                 "INTERNAL ERROR: recursive push_string!"));
       abort ();
     }
+  assert (!token_view);
 
   /* Prefer reusing an older block, for tail-call optimization.  */
-  while (isp && isp->type == INPUT_STRING && !isp->u.u_s.string[0])
-    pop_input ();
-  next = (input_block *) obstack_alloc (current_input,
-                                        sizeof (struct input_block));
+  pop_exhausted_strings ();
+  if (isp)
+    count_input_lines (isp);
+  next = alloc_block ();
   next->type = INPUT_STRING;
   next->file = current_file;
   next->line = current_line;
+  /* Allocate a byte to free back to, since the text itself may move
+     to a new chunk as it grows, and may come after scratch objects
+     that would otherwise outlive the block.  */
+  next->u.u_s.text = (char *) obstack_alloc (current_input, 1);
 
   return current_input;
 }
@@ -268,11 +586,11 @@ push_string_init (void)
 /*-------------------------------------------------------------------.
 | Last half of push_string ().  If next is now NULL, a call to       |
 | push_file () has invalidated the previous call to push_string_init |
-| (), so we just give up.  If the new object is void, we do not push |
-| it.  The function push_string_finish () returns a pointer to the   |
-| finished object.  This pointer is only for temporary use, since    |
-| reading the next token might release the memory used for the       |
-| object.                                                            |
+| (), so we just give up.  If the new object is void, or was handed  |
+| out by push_string_inert (), we do not push it.  The function      |
+| push_string_finish () returns a pointer to the finished object.    |
+| This pointer is only for temporary use, since reading the next     |
+| token might release the memory used for the object.                |
 `-------------------------------------------------------------------*/
 
 const char *
@@ -283,20 +601,29 @@ push_string_finish (void)
   if (next == NULL)
     return NULL;
 
-  if (obstack_object_size (current_input) > 0)
+  if (obstack_object_size (current_input) > 0 && !next_inert)
     {
       size_t len = obstack_object_size (current_input);
       obstack_1grow (current_input, '\0');
-      next->u.u_s.string = (char *) obstack_finish (current_input);
-      next->u.u_s.end = next->u.u_s.string + len;
+      next->string = (char *) obstack_finish (current_input);
+      next->end = next->string + len;
       next->prev = isp;
       isp = next;
-      ret = isp->u.u_s.string; /* for immediate use only */
+      ret = isp->string; /* for immediate use only */
+      next = NULL;
       input_change = true;
+      pushback_count++;
+      pushback_bytes += len;
+      if (show_stats && current_input->chunk != input_chunk)
+        {
+          input_chunk = current_input->chunk;
+          len = obstack_memory_used (current_input);
+          if (len > input_peak)
+            input_peak = len;
+        }
     }
   else
-    obstack_free (current_input, next); /* people might leave garbage on it. */
-  next = NULL;
+    discard_next (); /* people might leave garbage on it. */
   return ret;
 }
 
@@ -314,14 +641,14 @@ push_wrapup (const char *s)
 {
   size_t len = strlen (s);
   input_block *i;
-  i = (input_block *) obstack_alloc (wrapup_stack,
-                                     sizeof (struct input_block));
+  i = alloc_block ();
   i->prev = wsp;
   i->type = INPUT_STRING;
   i->file = current_file;
   i->line = current_line;
-  i->u.u_s.string = (char *) obstack_copy0 (wrapup_stack, s, len);
-  i->u.u_s.end = i->u.u_s.string + len;
+  i->u.u_s.text = (char *) obstack_copy0 (wrapup_stack, s, len);
+  i->string = i->u.u_s.text;
+  i->end = i->string + len;
   wsp = i;
 }
 
@@ -338,9 +665,13 @@ pop_input (void)
 {
   input_block *tmp = isp->prev;
 
+  discard_next (); /* might be set in push_string_init () */
   switch (isp->type)
     {
     case INPUT_STRING:
+      obstack_free (current_input, isp->u.u_s.text);
+      break;
+
     case INPUT_MACRO:
       break;
 
@@ -349,12 +680,12 @@ pop_input (void)
         {
           if (tmp)
             DEBUG_MESSAGE2 ("input reverted to %s, line %d",
-                            tmp->file, tmp->line);
+                            tmp->file, count_input_lines (tmp));
           else
             DEBUG_MESSAGE ("input exhausted");
         }
 
-      if (ferror (isp->u.u_f.fp))
+      if (ferror (isp->u.u_f.fp) || isp->u.u_f.error)
         {
           M4ERROR ((warning_status, 0, _("read error")));
           if (isp->u.u_f.close)
@@ -366,6 +697,7 @@ pop_input (void)
           M4ERROR ((warning_status, errno, _("error reading file")));
           retcode = EXIT_FAILURE;
         }
+      free (isp->u.u_f.buffer);
       start_of_input_line = isp->u.u_f.advance;
       output_current_line = -1;
       break;
@@ -375,8 +707,7 @@ pop_input (void)
                 "INTERNAL ERROR: input stack botch in pop_input ()"));
       abort ();
     }
-  obstack_free (current_input, isp);
-  next = NULL; /* might be set in push_string_init () */
+  free_block (isp);
 
   isp = tmp;
   input_change = true;
@@ -392,6 +723,11 @@ pop_input (void)
 bool
 pop_wrapup (void)
 {
+  input_block *block;
+  union input_segment *segment;
+
+  if (next != NULL)
+    free_block (next);
   next = NULL;
   obstack_free (current_input, NULL);
   free (current_input);
@@ -401,18 +737,28 @@ pop_wrapup (void)
       /* End of the program.  Free all memory even though we are about
          to exit, since it makes leak detection easier.  */
       obstack_free (&token_stack, NULL);
-      obstack_free (&file_names, NULL);
       obstack_free (wrapup_stack, NULL);
       free (wrapup_stack);
+      while ((block = free_blocks) != NULL)
+        {
+          free_blocks = block->prev;
+          free (block);
+        }
+      while ((segment = free_segments) != NULL)
+        {
+          free_segments = segment->s.next;
+          free (segment);
+        }
 #ifdef ENABLE_CHANGEWORD
       regfree (&word_regexp);
+      free_word_nfa ();
 #endif /* ENABLE_CHANGEWORD */
       return false;
     }
 
   current_input = wrapup_stack;
   wrapup_stack = (struct obstack *) xmalloc (sizeof (struct obstack));
-  obstack_init (wrapup_stack);
+  init_input_obstack (wrapup_stack);
 
   isp = wsp;
   wsp = NULL;
@@ -462,12 +808,18 @@ peek_input (void)
       switch (block->type)
         {
         case INPUT_STRING:
-          ch = to_uchar (block->u.u_s.string[0]);
+          ch = to_uchar (block->string[0]);
           if (ch != '\0')
             return ch;
           break;
 
         case INPUT_FILE:
+          if (block->u.u_f.buffer)
+            {
+              if (block->string < block->end || fill_input_buffer (block))
+                return to_uchar (*block->string);
+              break;
+            }
           ch = getc (block->u.u_f.fp);
           if (ch != EOF)
             {
@@ -496,13 +848,14 @@ peek_input (void)
 | consisting of a newline alone is taken as belonging to the line it |
 | ends, and the current line number is not incremented until the     |
 | next character is read.  99.9% of all calls will read from a       |
-| string, so factor that out into a macro for speed.                 |
+| string or a file buffer, so factor that out into a macro for       |
+| speed; the line number of a file is then brought up to date later, |
+| by count_input_lines ().                                           |
 `-------------------------------------------------------------------*/
 
 #define next_char() \
-  (isp && isp->type == INPUT_STRING && isp->u.u_s.string[0]     \
-   && !input_change                                             \
-   ? to_uchar (*isp->u.u_s.string++)                            \
+  (isp && isp->string[0] && !input_change                       \
+   ? to_uchar (*isp->string++)                                  \
    : next_char_1 ())
 
 static int
@@ -522,19 +875,34 @@ next_char_1 (void)
       if (input_change)
         {
           current_file = isp->file;
-          current_line = isp->line;
+          current_line = count_input_lines (isp);
           input_change = false;
         }
 
       switch (isp->type)
         {
         case INPUT_STRING:
-          ch = to_uchar (*isp->u.u_s.string++);
+          ch = to_uchar (*isp->string++);
           if (ch != '\0')
             return ch;
           break;
 
         case INPUT_FILE:
+          if (isp->u.u_f.buffer)
+            {
+              if (isp->string < isp->end || fill_input_buffer (isp))
+                return to_uchar (*isp->string++);
+
+              /* Trying to read past a final newline goes on to the
+                 next line, as below.  */
+              current_line = count_input_lines (isp);
+              if (isp->u.u_f.newline)
+                {
+                  isp->u.u_f.newline = false;
+                  current_line = ++isp->line;
+                }
+              break;
+            }
           if (start_of_input_line)
             {
               start_of_input_line = false;
@@ -602,7 +970,8 @@ skip_line (void)
 | input stream.  If the string matches the input and consume is     |
 | true, the input is discarded; otherwise any characters read are   |
 | pushed back again.  The function is used only when multicharacter |
-| quotes or comment delimiters are used.                            |
+| quotes or comment delimiters are used.  Nothing needs pushing     |
+| back unless the match runs past the end of a string block.        |
 `------------------------------------------------------------------*/
 
 static bool
@@ -613,6 +982,27 @@ match_input (const char *s, bool consume)
   const char *t;
   bool result = false;
 
+  /* Most of the time, the rest of the string can be compared in place
+     against the string or file buffer on top of the input stack.  Only
+     fall back to reading characters one at a time if that block ends
+     before the comparison is decided.  */
+  if (isp && !input_change)
+    {
+      const char *buffer = isp->string;
+      size_t i;
+
+      for (i = 0; s[i] != '\0' && buffer[i] == s[i]; i++)
+        ;
+      if (s[i] == '\0')
+        {
+          if (consume)
+            isp->string += i;
+          return true;
+        }
+      if (buffer[i] != '\0')
+        return false;
+    }
+
   ch = peek_input ();
   if (ch != to_uchar (*s))
     return false;                       /* fail */
@@ -663,8 +1053,104 @@ match_input (const char *s, bool consume)
   (to_uchar ((s)[0]) == (ch)                                            \
    && (ch) != '\0'                                                      \
    && ((s)[1] == '\0' || (match_input ((s) + (consume), consume))))
+
+/*-------------------------------------------------------------------.
+| The lexer classifies each input byte with a single lookup in       |
+| char_class, rather than by comparing it against every delimiter in |
+| turn.  A byte can belong to several classes, such as a letter used |
+| as the first byte of the quotes; next_token () then tries them in  |
+| the usual order.  CHAR_EOF and CHAR_MACRO have no class.  The      |
+| table is rebuilt by set_char_classes () whenever the quotes, the   |
+| comment delimiters or the word syntax change.                      |
+`-------------------------------------------------------------------*/
+
+#define CHAR_CLASS_BCOMM        1       /* first byte of bcomm */
+#define CHAR_CLASS_WORD_START   2       /* may start a word */
+#define CHAR_CLASS_WORD         4       /* may go on in a default word */
+#define CHAR_CLASS_LQUOTE       8       /* first byte of lquote */
+#define CHAR_CLASS_SPECIAL      16      /* `(', `,' or `)' */
+#define CHAR_CLASS_PLAIN        32      /* none of the above, nor NUL */
+#define CHAR_CLASS_UTF8         64      /* lead byte, with --utf8 */
+
+static unsigned char char_class[CHAR_MACRO + 1];
+
+static void
+set_char_classes (void)
+{
+  int ch;
+
+  for (ch = 0; ch <= UCHAR_MAX; ch++)
+    {
+      int flags = 0;
+
+      if (default_word_regexp)
+        {
+          if (c_isalpha (ch) || ch == '_')
+            flags |= CHAR_CLASS_WORD_START;
+          if (c_isalnum (ch) || ch == '_')
+            flags |= CHAR_CLASS_WORD;
+        }
+#ifdef ENABLE_CHANGEWORD
+      else if (word_regexp.fastmap[ch])
+        flags |= CHAR_CLASS_WORD_START;
+#endif /* ENABLE_CHANGEWORD */
+      if (ch == '(' || ch == ',' || ch == ')')
+        flags |= CHAR_CLASS_SPECIAL;
+      if (ch != '\0' && ch == to_uchar (*bcomm.string))
+        flags |= CHAR_CLASS_BCOMM;
+      if (ch != '\0' && ch == to_uchar (*lquote.string))
+        flags |= CHAR_CLASS_LQUOTE;
+      if (utf8_mode && default_word_regexp && ch >= 0xC2 && ch <= 0xF4)
+        flags |= CHAR_CLASS_UTF8;
+      if (flags == 0 && ch != '\0')
+        flags = CHAR_CLASS_PLAIN;
+      char_class[ch] = flags;
+    }
+}
 
 
+/*-------------------------------------------------------------------.
+| Alternative to push_string_finish (), for text that need not be    |
+| rescanned.  If the text collected since push_string_init () is not |
+| empty, and none of its bytes can start a word, a quoted string or  |
+| a comment, or is a parenthesis, a comma or a NUL, then rescanning  |
+| it could only pass it through unchanged, as a run of plain or      |
+| simple tokens, whatever input follows it.  In that case return it, |
+| NUL-terminated, with its length in *LENGTH; it is not pushed, but  |
+| stays valid until push_string_finish () is called, which is still  |
+| required.  Otherwise return NULL and change nothing.               |
+`-------------------------------------------------------------------*/
+
+#define INERT_CHAR(Ch)                                                  \
+  ((char_class[Ch] & (CHAR_CLASS_WORD_START | CHAR_CLASS_BCOMM          \
+                      | CHAR_CLASS_LQUOTE | CHAR_CLASS_SPECIAL          \
+                      | CHAR_CLASS_UTF8)) == 0 && (Ch) != '\0')
+
+const char *
+push_string_inert (size_t *length)
+{
+  const char *text;
+  size_t len;
+  size_t i;
+
+  if (next == NULL || next_inert)
+    return NULL;
+  len = obstack_object_size (current_input);
+  if (len == 0)
+    return NULL;
+  text = (char *) obstack_base (current_input);
+  for (i = 0; i < len; i++)
+    if (!INERT_CHAR (to_uchar (text[i])))
+      return NULL;
+
+  obstack_1grow (current_input, '\0');
+  next_inert = true;
+  inert_count++;
+  inert_bytes += len;
+  *length = len;
+  return (char *) obstack_base (current_input);
+}
+
 /*--------------------------------------------------------.
 | Initialize input stacks, and quote/comment characters.  |
 `--------------------------------------------------------*/
@@ -676,11 +1162,9 @@ input_init (void)
   current_line = 0;
 
   current_input = (struct obstack *) xmalloc (sizeof (struct obstack));
-  obstack_init (current_input);
+  init_input_obstack (current_input);
   wrapup_stack = (struct obstack *) xmalloc (sizeof (struct obstack));
-  obstack_init (wrapup_stack);
-
-  obstack_init (&file_names);
+  init_input_obstack (wrapup_stack);
 
   /* Allocate an object in the current chunk, so that obstack_free
      will always work even if the first token parsed spills to a new
@@ -707,6 +1191,7 @@ input_init (void)
 #ifdef ENABLE_CHANGEWORD
   set_word_regexp (user_word_regexp);
 #endif
+  set_char_classes ();
 }
 
 
@@ -741,6 +1226,7 @@ set_quotes (const char *lq, const char *rq)
   lquote.length = strlen (lquote.string);
   rquote.string = xstrdup (rq);
   rquote.length = strlen (rquote.string);
+  set_char_classes ();
 }
 
 void
@@ -765,10 +1251,374 @@ set_comment (const char *bc, const char *ec)
   bcomm.length = strlen (bcomm.string);
   ecomm.string = xstrdup (ec);
   ecomm.length = strlen (ecomm.string);
+  set_char_classes ();
 }
 
 #ifdef ENABLE_CHANGEWORD
 
+/*-------------------------------------------------------------------.
+| With a word regexp other than the default, next_token () grows a   |
+| word for as long as the word so far is matched by the regexp in    |
+| its entirety.  Checking that with re_search () over the whole word |
+| after each byte is quadratic in the length of the word, so common  |
+| regexps are also compiled into a Thompson NFA, whose set of states |
+| is advanced one byte at a time instead.  The NFA knows literals,   |
+| ".", bracket expressions, "\(...\)", "\|" and the "*", "+" and "?" |
+| operators; a regexp using anything else, such as anchors or        |
+| back-references, is left to the re_search () loop.  The bytes      |
+| matched by "." and by bracket expressions are found by asking the  |
+| regex engine, so that the NFA agrees with it in any locale.        |
+`-------------------------------------------------------------------*/
+
+static void
+free_word_nfa (void)
+{
+  size_t i;
+
+  for (i = 0; i < word_node_count; i++)
+    free (word_nodes[i].set);
+  free (word_nodes);
+  free (word_states);
+  free (word_next_states);
+  free (word_marks);
+  word_nodes = NULL;
+  word_node_count = 0;
+  word_node_alloc = 0;
+  word_states = NULL;
+  word_next_states = NULL;
+  word_marks = NULL;
+}
+
+/* Append a node to the NFA, and return its index.  */
+static int
+add_word_node (enum word_node_type type, int next, int next2, char *set)
+{
+  struct word_node *node;
+
+  if (word_node_count == word_node_alloc)
+    word_nodes = x2nrealloc (word_nodes, &word_node_alloc,
+                             sizeof *word_nodes);
+  node = &word_nodes[word_node_count];
+  node->type = type;
+  node->next = next;
+  node->next2 = next2;
+  node->set = set;
+  return word_node_count++;
+}
+
+/* Return a fragment matching one byte out of SET.  */
+static struct word_fragment
+word_fragment_set (char *set)
+{
+  struct word_fragment frag;
+
+  frag.last = add_word_node (WORD_NODE_EPSILON, -1, -1, NULL);
+  frag.first = add_word_node (WORD_NODE_SET, frag.last, -1, set);
+  return frag;
+}
+
+/* Return the set of bytes matched by the LENGTH bytes of PATTERN, a
+   single "." or bracket expression, or NULL if the NFA cannot use
+   it.  In a multibyte locale, a byte outside ASCII may be part of a
+   character, which the NFA would not see as a whole.  */
+static char *
+probe_word_set (const char *pattern, size_t length)
+{
+  struct re_pattern_buffer buf;
+  char *set;
+  int ch;
+
+  init_pattern_buffer (&buf, NULL);
+  regex_compile_count++;
+  if (re_compile_pattern (pattern, length, &buf))
+    {
+      regfree (&buf);
+      return NULL;
+    }
+  set = xcharalloc (UCHAR_MAX + 1);
+  for (ch = 0; ch <= UCHAR_MAX; ch++)
+    {
+      char byte = ch;
+
+      set[ch] = re_match (&buf, &byte, 1, 0, NULL) == 1;
+      if (set[ch] && !c_isascii (ch) && MB_CUR_MAX > 1)
+        {
+          free (set);
+          set = NULL;
+          break;
+        }
+    }
+  regfree (&buf);
+  return set;
+}
+
+/* Return the set holding just the byte CH, or NULL as above.  */
+static char *
+literal_word_set (unsigned char ch)
+{
+  char *set;
+
+  if (!c_isascii (ch) && MB_CUR_MAX > 1)
+    return NULL;
+  set = xzalloc (UCHAR_MAX + 1);
+  set[ch] = 1;
+  return set;
+}
+
+static bool parse_word_alternation (const char **, bool,
+                                    struct word_fragment *);
+
+/* Parse an atom at *PP and the operators following it into *FRAG,
+   and advance *PP past them.  Return false if the NFA cannot handle
+   the atom.  */
+static bool
+parse_word_piece (const char **pp, struct word_fragment *frag)
+{
+  const char *p = *pp;
+  const char *end;
+  char *set;
+  int exit;
+  int split;
+
+  switch (*p)
+    {
+    case '*': case '+': case '?': case '^': case '$':
+      /* Either literal or special, depending on the context.  */
+      return false;
+
+    case '.':
+      set = probe_word_set (p++, 1);
+      if (!set)
+        return false;
+      *frag = word_fragment_set (set);
+      break;
+
+    case '[':
+      end = p + 1;
+      if (*end == '^')
+        end++;
+      if (*end == ']')
+        end++;
+      while (*end != ']')
+        {
+          /* Character classes and friends are not worth the bother.  */
+          if (*end == '\0' || *end == '[')
+            return false;
+          end++;
+        }
+      set = probe_word_set (p, end + 1 - p);
+      if (!set)
+        return false;
+      *frag = word_fragment_set (set);
+      p = end + 1;
+      break;
+
+    case '\\':
+      if (p[1] == '(')
+        {
+          p += 2;
+          if (!parse_word_alternation (&p, true, frag))
+            return false;
+          break;
+        }
+      if (p[1] == '\0' || !strchr (".*[]\\^$+?", p[1]))
+        return false;
+      p++;
+      FALLTHROUGH;
+
+    default:
+      set = literal_word_set (*p++);
+      if (!set)
+        return false;
+      *frag = word_fragment_set (set);
+      break;
+    }
+
+  while (*p == '*' || *p == '+' || *p == '?')
+    {
+      exit = add_word_node (WORD_NODE_EPSILON, -1, -1, NULL);
+      split = add_word_node (WORD_NODE_SPLIT, frag->first, exit, NULL);
+      switch (*p++)
+        {
+        case '*':
+          word_nodes[frag->last].next = split;
+          frag->first = split;
+          break;
+
+        case '+':
+          word_nodes[frag->last].next = split;
+          break;
+
+        default:
+          word_nodes[frag->last].next = exit;
+          frag->first = split;
+          break;
+        }
+      frag->last = exit;
+    }
+  *pp = p;
+  return true;
+}
+
+/* Parse the pieces at *PP up to "\|", "\)" or the end of the regexp
+   into *FRAG.  An empty branch is left to re_search ().  */
+static bool
+parse_word_branch (const char **pp, struct word_fragment *frag)
+{
+  struct word_fragment piece;
+  bool empty = true;
+
+  while (**pp && !(**pp == '\\' && ((*pp)[1] == '|' || (*pp)[1] == ')')))
+    {
+      if (!parse_word_piece (pp, &piece))
+        return false;
+      if (empty)
+        *frag = piece;
+      else
+        {
+          word_nodes[frag->last].next = piece.first;
+          frag->last = piece.last;
+        }
+      empty = false;
+    }
+  return !empty;
+}
+
+/* Parse the branches at *PP separated by "\|" into *FRAG.  If NESTED,
+   they are closed by "\)", which is skipped, else they must extend to
+   the end of the regexp.  */
+static bool
+parse_word_alternation (const char **pp, bool nested,
+                        struct word_fragment *frag)
+{
+  struct word_fragment right;
+  int exit;
+  int split;
+
+  if (!parse_word_branch (pp, frag))
+    return false;
+  while (**pp == '\\' && (*pp)[1] == '|')
+    {
+      *pp += 2;
+      if (!parse_word_branch (pp, &right))
+        return false;
+      exit = add_word_node (WORD_NODE_EPSILON, -1, -1, NULL);
+      split = add_word_node (WORD_NODE_SPLIT, frag->first, right.first, NULL);
+      word_nodes[frag->last].next = exit;
+      word_nodes[right.last].next = exit;
+      frag->first = split;
+      frag->last = exit;
+    }
+  if (!nested)
+    return **pp == '\0';
+  if (!(**pp == '\\' && (*pp)[1] == ')'))
+    return false;
+  *pp += 2;
+  return true;
+}
+
+/* Compile REGEXP into the NFA, or leave word_nodes NULL if it is
+   beyond the NFA.  */
+static void
+compile_word_nfa (const char *regexp)
+{
+  struct word_fragment frag;
+  int match;
+
+  free_word_nfa ();
+  if (!parse_word_alternation (&regexp, false, &frag))
+    {
+      free_word_nfa ();
+      return;
+    }
+  match = add_word_node (WORD_NODE_MATCH, -1, -1, NULL);
+  word_nodes[frag.last].next = match;
+  word_start = frag.first;
+  word_states = xnmalloc (word_node_count, sizeof *word_states);
+  word_next_states = xnmalloc (word_node_count, sizeof *word_next_states);
+  word_marks = xcalloc (word_node_count, sizeof *word_marks);
+  word_generation = 0;
+}
+
+/* Start a new generation of marks for add_word_state ().  */
+static void
+next_word_generation (void)
+{
+  if (++word_generation == 0)
+    {
+      memset (word_marks, 0, word_node_count * sizeof *word_marks);
+      word_generation = 1;
+    }
+}
+
+/* Add node S, and the nodes it leads to without consuming a byte, to
+   the set of *COUNT states in STATES.  */
+static void
+add_word_state (int *states, int *count, int s)
+{
+  if (word_marks[s] == word_generation)
+    return;
+  word_marks[s] = word_generation;
+  switch (word_nodes[s].type)
+    {
+    case WORD_NODE_EPSILON:
+      add_word_state (states, count, word_nodes[s].next);
+      break;
+
+    case WORD_NODE_SPLIT:
+      add_word_state (states, count, word_nodes[s].next);
+      add_word_state (states, count, word_nodes[s].next2);
+      break;
+
+    default:
+      states[(*count)++] = s;
+      break;
+    }
+}
+
+/* Advance the NFA over the byte CH, and return true if the word then
+   matches in its entirety.  Unless FORCE, the NFA is left alone when
+   it does not.  */
+static bool
+step_word_nfa (int ch, bool force)
+{
+  int count = 0;
+  bool match = false;
+  int *states;
+  int i;
+
+  next_word_generation ();
+  for (i = 0; i < word_state_count; i++)
+    {
+      struct word_node *node = &word_nodes[word_states[i]];
+
+      if (node->type == WORD_NODE_SET && node->set[ch])
+        add_word_state (word_next_states, &count, node->next);
+    }
+  for (i = 0; i < count; i++)
+    if (word_nodes[word_next_states[i]].type == WORD_NODE_MATCH)
+      match = true;
+
+  if (match || force)
+    {
+      states = word_states;
+      word_states = word_next_states;
+      word_next_states = states;
+      word_state_count = count;
+    }
+  return match;
+}
+
+/* Start the NFA on CH, the first byte of a word.  */
+static void
+start_word_nfa (int ch)
+{
+  word_state_count = 0;
+  next_word_generation ();
+  add_word_state (word_states, &word_state_count, word_start);
+  step_word_nfa (ch, true);
+}
+
 void
 set_word_regexp (const char *regexp)
 {
@@ -778,11 +1628,13 @@ set_word_regexp (const char *regexp)
   if (!*regexp || STREQ (regexp, DEFAULT_WORD_REGEXP))
     {
       default_word_regexp = true;
+      set_char_classes ();
       return;
     }
 
   /* Dry run to see whether the new expression is compilable.  */
   init_pattern_buffer (&new_word_regexp, NULL);
+  regex_compile_count++;
   msg = re_compile_pattern (regexp, strlen (regexp), &new_word_regexp);
   regfree (&new_word_regexp);
 
@@ -799,31 +1651,267 @@ set_word_regexp (const char *regexp)
      by the final regfree.  */
   if (!word_regexp.fastmap)
     word_regexp.fastmap = xcharalloc (UCHAR_MAX + 1);
+  regex_compile_count++;
   msg = re_compile_pattern (regexp, strlen (regexp), &word_regexp);
   assert (!msg);
   re_set_registers (&word_regexp, &regs, regs.num_regs, regs.start, regs.end);
   if (re_compile_fastmap (&word_regexp))
     assert (false);
+  compile_word_nfa (regexp);
 
   default_word_regexp = false;
+  set_char_classes ();
 }
 
 #endif /* ENABLE_CHANGEWORD */
 
 
+/*-------------------------------------------------------------------.
+| With the default word syntax, most bytes of the input can be taken |
+| in bulk straight from the block on top of the input stack, rather  |
+| than through peek_input () and next_char () one at a time.         |
+| grow_word_run () appends the rest of a word as far as the block    |
+| holds it; the caller then continues byte by byte, in case the word |
+| goes on in the next block.                                         |
+`-------------------------------------------------------------------*/
+
+static void
+grow_word_run (void)
+{
+  if (isp == NULL || input_change)
+    return;
+
+  if (isp->string[0])
+    {
+      const char *start = isp->string;
+      const char *p = start;
+
+      while (char_class[to_uchar (*p)] & CHAR_CLASS_WORD)
+        p++;
+      obstack_grow (&token_stack, start, p - start);
+      isp->string += p - start;
+    }
+  else if (isp->type == INPUT_FILE && !isp->u.u_f.buffer && !isp->u.u_f.end)
+    {
+      FILE *fp = isp->u.u_f.fp;
+      int ch;
+
+      while ((ch = getc (fp)) != EOF && (char_class[ch] & CHAR_CLASS_WORD))
+        obstack_1grow (&token_stack, ch);
+      if (ch == EOF)
+        isp->u.u_f.end = true;
+      else
+        ungetc (ch, fp);
+    }
+}
+
+/*-------------------------------------------------------------------.
+| With --utf8 and the default word syntax, a word may also contain   |
+| non-ASCII letters.  Their lead bytes are classed CHAR_CLASS_UTF8,  |
+| so that plain runs stop short of them, and grow_utf8_char () reads |
+| the rest of the character whose lead byte CH was just read,        |
+| appending it to the current token.  It returns true if the         |
+| character is a letter, or with ALNUM, a letter or a digit, as      |
+| told by the current locale.  A malformed sequence is no letter,    |
+| and only the bytes read so far belong to it.                       |
+`-------------------------------------------------------------------*/
+
+static bool
+grow_utf8_char (int ch, bool alnum)
+{
+  int count = ch < 0xE0 ? 1 : ch < 0xF0 ? 2 : 3;
+  unsigned int wc = ch & (0x3F >> count);
+  int i;
+
+  obstack_1grow (&token_stack, ch);
+  for (i = 0; i < count; i++)
+    {
+      ch = peek_input ();
+      if (ch < 0x80 || ch > 0xBF)
+        return false;
+      next_char ();
+      obstack_1grow (&token_stack, ch);
+      wc = (wc << 6) | (ch & 0x3F);
+    }
+  if ((count == 2 && wc < 0x800) || (wc >= 0xD800 && wc <= 0xDFFF)
+      || (count == 3 && (wc < 0x10000 || wc > 0x10FFFF)))
+    return false;
+  return alnum ? iswalnum (wc) != 0 : iswalpha (wc) != 0;
+}
+
+/*-----------------------------------------------------------------.
+| Grow the rest of a default word, whose first character is in the |
+| current token.  A non-ASCII character that turns out not to be a |
+| letter or digit is taken back off the token and pushed back on   |
+| the input, to be read again as the start of the next token.      |
+`-----------------------------------------------------------------*/
+
+static void
+grow_word_tail (void)
+{
+  int ch;
+
+  grow_word_run ();
+  while (1)
+    {
+      ch = peek_input ();
+      if (char_class[ch] & CHAR_CLASS_WORD)
+        {
+          obstack_1grow (&token_stack, ch);
+          next_char ();
+        }
+      else if (char_class[ch] & CHAR_CLASS_UTF8)
+        {
+          size_t mark = obstack_object_size (&token_stack);
+          size_t length;
+
+          next_char ();
+          if (grow_utf8_char (ch, true))
+            continue;
+          length = obstack_object_size (&token_stack) - mark;
+          obstack_grow (push_string_init (),
+                        (char *) obstack_base (&token_stack) + mark, length);
+          push_string_finish ();
+          obstack_blank_fast (&token_stack, -(int) length);
+          break;
+        }
+      else
+        break;
+    }
+}
+
+/*---------------------------------------------------------------------.
+| A plain character is one that cannot start a word, a quoted string   |
+| or a comment, and is neither a parenthesis nor a comma.  Between     |
+| words, most text is made of these, and grow_plain_run () gathers     |
+| as many as the top input block holds into the current token, so      |
+| that they are expanded and shipped out as a single TOKEN_PLAIN.  A   |
+| run ends after a newline, which keeps line numbers and synclines     |
+| exact.  Return the number of bytes added.  A run from a string or    |
+| a file buffer is not copied: *VIEW is set to the byte next_token ()  |
+| just read from it, which the run follows, and the token refers to    |
+| the block.                                                           |
+`---------------------------------------------------------------------*/
+
+#define PLAIN_CHAR(Ch) (char_class[Ch] & CHAR_CLASS_PLAIN)
+
+static size_t
+grow_plain_run (const char **view)
+{
+  size_t length = 0;
+
+  if (isp == NULL || input_change)
+    return 0;
+
+  if (isp->string[0])
+    {
+      const char *start = isp->string;
+      const char *p = start;
+
+      while (PLAIN_CHAR (to_uchar (*p)))
+        if (*p++ == '\n')
+          break;
+      length = p - start;
+      if (length)
+        *view = start - 1;
+      isp->string += p - start;
+    }
+  else if (isp->type == INPUT_FILE && !isp->u.u_f.buffer && !isp->u.u_f.end
+           && !start_of_input_line)
+    {
+      FILE *fp = isp->u.u_f.fp;
+      int ch;
+
+      while ((ch = getc (fp)) != EOF)
+        {
+          if (!PLAIN_CHAR (ch))
+            {
+              ungetc (ch, fp);
+              break;
+            }
+          obstack_1grow (&token_stack, ch);
+          length++;
+          if (ch == '\n')
+            {
+              start_of_input_line = true;
+              break;
+            }
+        }
+      if (ch == EOF)
+        isp->u.u_f.end = true;
+    }
+  return length;
+}
+
+/*------------------------------------------------------------------.
+| Inside a comment, append to the current token all the bytes of    |
+| the top input block up to the next one that may start the end of  |
+| the comment, which is left unread for next_token () to check.     |
+| Bytes read from a file are counted for line numbers exactly as    |
+| next_char () would count them.                                    |
+`------------------------------------------------------------------*/
+
+static void
+grow_comment_run (void)
+{
+  if (isp == NULL || input_change)
+    return;
+
+  if (isp->string[0])
+    {
+      const char *start = isp->string;
+      const char *p;
+
+      p = (char *) memchr (start, *ecomm.string, isp->end - start);
+      if (p == NULL)
+        p = isp->end;
+      obstack_grow (&token_stack, start, p - start);
+      isp->string += p - start;
+    }
+  else if (isp->type == INPUT_FILE && !isp->u.u_f.buffer && !isp->u.u_f.end)
+    {
+      FILE *fp = isp->u.u_f.fp;
+      int ch;
+
+      while ((ch = getc (fp)) != EOF)
+        {
+          if (ch == to_uchar (*ecomm.string))
+            {
+              ungetc (ch, fp);
+              break;
+            }
+          if (start_of_input_line)
+            {
+              start_of_input_line = false;
+              current_line = ++isp->line;
+            }
+          obstack_1grow (&token_stack, ch);
+          if (ch == '\n')
+            start_of_input_line = true;
+        }
+      if (ch == EOF)
+        isp->u.u_f.end = true;
+    }
+}
+
 /*--------------------------------------------------------------------.
 | Parse and return a single token from the input stream.  A token     |
 | can either be TOKEN_EOF, if the input_stack is empty; it can be     |
 | TOKEN_STRING for a quoted string; TOKEN_WORD for something that is  |
 | a potential macro name; and TOKEN_SIMPLE for any single character   |
-| that is not a part of any of the previous types.  If LINE is not    |
-| NULL, set *LINE to the line where the token starts.                 |
+| that is not a part of any of the previous types, or TOKEN_PLAIN for |
+| a run of such characters that cannot start a token of their own.    |
+| If LINE is not NULL, set *LINE to the line where the token starts.  |
 |                                                                     |
 | Next_token () return the token type, and passes back a pointer to   |
 | the token data through TD.  The token text is collected on the      |
 | obstack token_stack, which never contains more than one token text  |
-| at a time.  The storage pointed to by the fields in TD is           |
-| therefore subject to change the next time next_token () is called.  |
+| at a time.  A quoted string or a run of plain text that lies within |
+| a single string or file buffer is not copied; TD then points into   |
+| the block itself, and the text is not NUL-terminated, so consumers  |
+| must go by its length.  The storage pointed to by the fields in TD  |
+| is therefore subject to change the next time next_token () is       |
+| called.                                                             |
 `--------------------------------------------------------------------*/
 
 token_type
@@ -832,17 +1920,38 @@ next_token (token_data *td, int *line)
   int ch;
   int quote_level;
   token_type type;
+  int flags;
 #ifdef ENABLE_CHANGEWORD
-  int startpos;
+  int startpos = -1;
   char *orig_text = NULL;
 #endif
   const char *file;
   int dummy;
+  const char *view = NULL;
+  size_t view_length = 0;
 
   obstack_free (&token_stack, token_bottom);
+  token_view = false;
   if (!line)
     line = &dummy;
 
+  if (open_pending)
+    {
+      open_pending = false;
+      *line = open_line;
+      token_count[TOKEN_OPEN]++;
+      TOKEN_DATA_TYPE (td) = TOKEN_TEXT;
+      TOKEN_DATA_TEXT (td) = (char *) "(";
+      TOKEN_DATA_LEN (td) = 1;
+#ifdef ENABLE_CHANGEWORD
+      TOKEN_DATA_ORIG_TEXT (td) = TOKEN_DATA_TEXT (td);
+#endif
+#ifdef DEBUG_INPUT
+      xfprintf (stderr, "next_token -> OPEN (()\n");
+#endif
+      return TOKEN_OPEN;
+    }
+
  /* Can't consume character until after CHAR_MACRO is handled.  */
   ch = peek_input ();
   if (ch == CHAR_EOF)
@@ -851,6 +1960,7 @@ next_token (token_data *td, int *line)
       xfprintf (stderr, "next_token -> EOF\n");
 #endif
       next_char ();
+      token_count[TOKEN_EOF]++;
       return TOKEN_EOF;
     }
   if (ch == CHAR_MACRO)
@@ -861,18 +1971,26 @@ next_token (token_data *td, int *line)
       xfprintf (stderr, "next_token -> MACDEF (%s)\n",
                 find_builtin_by_addr (TOKEN_DATA_FUNC (td))->name);
 #endif
+      token_count[TOKEN_MACDEF]++;
       return TOKEN_MACDEF;
     }
 
   next_char (); /* Consume character we already peeked at.  */
+  update_current_line ();
   file = current_file;
   *line = current_line;
-  if (MATCH (ch, bcomm.string, true))
+  flags = char_class[ch];
+  if ((flags & CHAR_CLASS_BCOMM) && MATCH (ch, bcomm.string, true))
     {
       obstack_grow (&token_stack, bcomm.string, bcomm.length);
-      while ((ch = next_char ()) != CHAR_EOF
-             && !MATCH (ch, ecomm.string, true))
-        obstack_1grow (&token_stack, ch);
+      while (1)
+        {
+          grow_comment_run ();
+          ch = next_char ();
+          if (ch == CHAR_EOF || MATCH (ch, ecomm.string, true))
+            break;
+          obstack_1grow (&token_stack, ch);
+        }
       if (ch != CHAR_EOF)
         obstack_grow (&token_stack, ecomm.string, ecomm.length);
       else
@@ -882,46 +2000,61 @@ next_token (token_data *td, int *line)
 
       type = TOKEN_STRING;
     }
-  else if (default_word_regexp && (c_isalpha (ch) || ch == '_'))
+  else if (default_word_regexp && (flags & CHAR_CLASS_WORD_START))
     {
       obstack_1grow (&token_stack, ch);
-      while ((ch = peek_input ()) != CHAR_EOF && (c_isalnum (ch) || ch == '_'))
-        {
-          obstack_1grow (&token_stack, ch);
-          next_char ();
-        }
+      grow_word_tail ();
       type = TOKEN_WORD;
     }
 
 #ifdef ENABLE_CHANGEWORD
 
-  else if (!default_word_regexp && word_regexp.fastmap[ch])
+  else if (!default_word_regexp && (flags & CHAR_CLASS_WORD_START))
     {
       obstack_1grow (&token_stack, ch);
-      while (1)
+      if (word_nodes)
         {
-          ch = peek_input ();
-          if (ch == CHAR_EOF)
-            break;
-          obstack_1grow (&token_stack, ch);
-          startpos = re_search (&word_regexp,
-                                (char *) obstack_base (&token_stack),
-                                obstack_object_size (&token_stack), 0, 0,
-                                &regs);
-          if (startpos ||
-              regs.end [0] != (regoff_t) obstack_object_size (&token_stack))
+          start_word_nfa (ch);
+          while ((ch = peek_input ()) < CHAR_EOF && step_word_nfa (ch, false))
             {
-              *(((char *) obstack_base (&token_stack)
-                 + obstack_object_size (&token_stack)) - 1) = '\0';
-              break;
+              obstack_1grow (&token_stack, ch);
+              next_char ();
             }
-          next_char ();
         }
+      else
+        while (1)
+          {
+            ch = peek_input ();
+            if (ch == CHAR_EOF)
+              break;
+            obstack_1grow (&token_stack, ch);
+            startpos = re_search (&word_regexp,
+                                  (char *) obstack_base (&token_stack),
+                                  obstack_object_size (&token_stack), 0, 0,
+                                  &regs);
+            if (startpos ||
+                regs.end [0] != (regoff_t) obstack_object_size (&token_stack))
+              {
+                *(((char *) obstack_base (&token_stack)
+                   + obstack_object_size (&token_stack)) - 1) = '\0';
+                break;
+              }
+            next_char ();
+          }
 
       obstack_1grow (&token_stack, '\0');
       orig_text = (char *) obstack_finish (&token_stack);
 
-      if (regs.start[1] != -1)
+      /* The NFA leaves the registers to a single search over the
+         finished word.  If even that fails, the word is a lone byte
+         that can only start a match; as the regexp should accept every
+         prefix of a word, take it whole.  */
+      if (startpos != 0)
+        startpos = re_search (&word_regexp, orig_text, strlen (orig_text),
+                              0, 0, &regs);
+      if (startpos != 0)
+        obstack_grow (&token_stack, orig_text, strlen (orig_text));
+      else if (regs.start[1] != -1)
         obstack_grow (&token_stack,orig_text + regs.start[1],
                       regs.end[1] - regs.start[1]);
       else
@@ -932,7 +2065,7 @@ next_token (token_data *td, int *line)
 
 #endif /* ENABLE_CHANGEWORD */
 
-  else if (!MATCH (ch, lquote.string, true))
+  else if (!((flags & CHAR_CLASS_LQUOTE) && MATCH (ch, lquote.string, true)))
     {
       switch (ch)
         {
@@ -949,7 +2082,25 @@ next_token (token_data *td, int *line)
           type = TOKEN_SIMPLE;
           break;
         }
-      obstack_1grow (&token_stack, ch);
+      if (flags & CHAR_CLASS_UTF8)
+        {
+          /* A non-ASCII character that is no letter is a token by
+             itself, like any other byte that cannot start a word.  */
+          if (grow_utf8_char (ch, false))
+            {
+              grow_word_tail ();
+              type = TOKEN_WORD;
+            }
+        }
+      else
+        obstack_1grow (&token_stack, ch);
+      if ((flags & CHAR_CLASS_PLAIN) && ch != '\n'
+          && (view_length = grow_plain_run (&view)) != 0)
+        {
+          type = TOKEN_PLAIN;
+          if (view)
+            view_length++;
+        }
     }
   else
     {
@@ -958,36 +2109,77 @@ next_token (token_data *td, int *line)
       while (1)
         {
           /* Try scanning a buffer first.  */
-          const char *buffer = (isp && isp->type == INPUT_STRING
-                                ? isp->u.u_s.string : NULL);
+          const char *buffer = isp ? isp->string : NULL;
           if (buffer && *buffer)
             {
-              size_t len = isp->u.u_s.end - buffer;
+              size_t len = isp->end - buffer;
               const char *p = buffer;
-              do
+              if (fast)
+                do
+                  {
+                    p = (char *) memchr2 (p, *lquote.string, *rquote.string,
+                                          buffer + len - p);
+                  }
+                while (p && (*p++ == *rquote.string
+                             ? --quote_level : ++quote_level));
+              else
+                /* Multicharacter quotes are compared in place as well,
+                   as long as the buffer holds enough bytes to decide.
+                   A candidate too close to its end is left to MATCH,
+                   since the delimiter may go on in the next block.  */
+                while ((p = (char *) memchr2 (p, *lquote.string,
+                                              *rquote.string,
+                                              buffer + len - p)))
+                  {
+                    size_t left = buffer + len - p;
+                    if (left >= rquote.length
+                        && memcmp (p, rquote.string, rquote.length) == 0)
+                      {
+                        p += rquote.length;
+                        if (--quote_level == 0)
+                          break;
+                      }
+                    /* MATCH tries the end-quote first, so one that may
+                       go on in the next block must not be taken for a
+                       start-quote here.  */
+                    else if (left < rquote.length
+                             && memcmp (p, rquote.string, left) == 0)
+                      break;
+                    else if (left >= lquote.length
+                             && memcmp (p, lquote.string, lquote.length) == 0)
+                      {
+                        p += lquote.length;
+                        quote_level++;
+                      }
+                    else if (left < lquote.length)
+                      break;
+                    else
+                      p++;
+                  }
+              if (p && !quote_level)
                 {
-                  p = (char *) memchr2 (p, *lquote.string, *rquote.string,
-                                        buffer + len - p);
+                  /* A string found whole in one block is not copied.  */
+                  if (obstack_object_size (&token_stack) == 0)
+                    {
+                      view = buffer;
+                      view_length = p - buffer - rquote.length;
+                    }
+                  else
+                    obstack_grow (&token_stack, buffer,
+                                  p - buffer - rquote.length);
+                  isp->string += p - buffer;
+                  break;
                 }
-              while (p && fast && (*p++ == *rquote.string
-                                   ? --quote_level : ++quote_level));
               if (p)
                 {
-                  if (fast)
-                    {
-                      assert (!quote_level);
-                      obstack_grow (&token_stack, buffer, p - buffer - 1);
-                      isp->u.u_s.string += p - buffer;
-                      break;
-                    }
                   obstack_grow (&token_stack, buffer, p - buffer);
                   ch = to_uchar (*p);
-                  isp->u.u_s.string += p - buffer + 1;
+                  isp->string += p - buffer + 1;
                 }
               else
                 {
                   obstack_grow (&token_stack, buffer, len);
-                  isp->u.u_s.string += len;
+                  isp->string += len;
                   continue;
                 }
             }
@@ -1017,32 +2209,52 @@ next_token (token_data *td, int *line)
       type = TOKEN_STRING;
     }
 
-  obstack_1grow (&token_stack, '\0');
-
+  token_count[type]++;
   TOKEN_DATA_TYPE (td) = TOKEN_TEXT;
-  TOKEN_DATA_TEXT (td) = (char *) obstack_finish (&token_stack);
+  if (view)
+    {
+      TOKEN_DATA_TEXT (td) = (char *) view;
+      TOKEN_DATA_LEN (td) = view_length;
+      token_view = true;
+    }
+  else
+    {
+      TOKEN_DATA_LEN (td) = obstack_object_size (&token_stack);
+      obstack_1grow (&token_stack, '\0');
+      if (obstack_object_size (&token_stack) > token_peak)
+        token_peak = obstack_object_size (&token_stack);
+      TOKEN_DATA_TEXT (td) = (char *) obstack_finish (&token_stack);
+    }
 #ifdef ENABLE_CHANGEWORD
   if (orig_text == NULL)
     orig_text = TOKEN_DATA_TEXT (td);
   TOKEN_DATA_ORIG_TEXT (td) = orig_text;
 #endif
 #ifdef DEBUG_INPUT
-  xfprintf (stderr, "next_token -> %s (%s)\n",
-            token_type_string (type), TOKEN_DATA_TEXT (td));
+  xfprintf (stderr, "next_token -> %s (%.*s)\n", token_type_string (type),
+            (int) TOKEN_DATA_LEN (td), TOKEN_DATA_TEXT (td));
 #endif
   return type;
 }
 
-/*-----------------------------------------------.
-| Peek at the next token from the input stream.  |
-`-----------------------------------------------*/
+/*--------------------------------------------------------------------.
+| Peek at the next token from the input stream.  An open parenthesis  |
+| is read right away, and handed back by the next call to             |
+| next_token (), which saves looking at it and classifying it twice.  |
+`--------------------------------------------------------------------*/
 
 token_type
 peek_token (void)
 {
   token_type result;
-  int ch = peek_input ();
+  int ch;
+  int flags;
 
+  if (open_pending)
+    return TOKEN_OPEN;
+
+  ch = peek_input ();
+  flags = char_class[ch];
   if (ch == CHAR_EOF)
     {
       result = TOKEN_EOF;
@@ -1051,19 +2263,15 @@ peek_token (void)
     {
       result = TOKEN_MACDEF;
     }
-  else if (MATCH (ch, bcomm.string, false))
+  else if ((flags & CHAR_CLASS_BCOMM) && MATCH (ch, bcomm.string, false))
     {
       result = TOKEN_STRING;
     }
-  else if ((default_word_regexp && (c_isalpha (ch) || ch == '_'))
-#ifdef ENABLE_CHANGEWORD
-           || (! default_word_regexp && word_regexp.fastmap[ch])
-#endif /* ENABLE_CHANGEWORD */
-           )
+  else if (flags & CHAR_CLASS_WORD_START)
     {
       result = TOKEN_WORD;
     }
-  else if (MATCH (ch, lquote.string, false))
+  else if ((flags & CHAR_CLASS_LQUOTE) && MATCH (ch, lquote.string, false))
     {
       result = TOKEN_STRING;
     }
@@ -1072,6 +2280,10 @@ peek_token (void)
       {
       case '(':
         result = TOKEN_OPEN;
+        next_char ();
+        update_current_line ();
+        open_pending = true;
+        open_line = current_line;
         break;
       case ',':
         result = TOKEN_COMMA;
@@ -1088,6 +2300,37 @@ peek_token (void)
 #endif /* DEBUG_INPUT */
   return result;
 }
+
+/*---------------------------------------.
+| Print input statistics, for --stats.   |
+`---------------------------------------*/
+
+void
+input_print_stats (void)
+{
+  uintmax_t total = 0;
+  int i;
+
+  for (i = 0; i <= TOKEN_MACDEF; i++)
+    total += token_count[i];
+  stats_message ("tokens: %ju total, %ju words, %ju strings, %ju simple, "
+                 "%ju plain, %ju open, %ju comma, %ju close, %ju macdef, "
+                 "%ju eof",
+                 total, token_count[TOKEN_WORD], token_count[TOKEN_STRING],
+                 token_count[TOKEN_SIMPLE], token_count[TOKEN_PLAIN],
+                 token_count[TOKEN_OPEN],
+                 token_count[TOKEN_COMMA], token_count[TOKEN_CLOSE],
+                 token_count[TOKEN_MACDEF], token_count[TOKEN_EOF]);
+  stats_message ("input: %ju bytes pushed back in %ju strings, "
+                 "%ju bytes in %ju strings not rescanned, "
+                 "largest token %zu bytes, input stack peak %zu bytes",
+                 pushback_bytes, pushback_count, inert_bytes, inert_count,
+                 token_peak, input_peak);
+  stats_message ("input pool: %ju blocks allocated, %ju reused, "
+                 "%ju segments allocated, %ju reused",
+                 block_count, block_reuse_count,
+                 segment_count, segment_reuse_count);
+}
 
 
 #ifdef DEBUG_INPUT
@@ -1111,6 +2354,8 @@ token_type_string (token_type t)
       return "CLOSE";
     case TOKEN_SIMPLE:
       return "SIMPLE";
+    case TOKEN_PLAIN:
+      return "PLAIN";
     case TOKEN_MACDEF:
       return "MACDEF";
     default:
@@ -1131,6 +2376,10 @@ print_token (const char *s, token_type t, token_data *td)
       xfprintf (stderr, "char:");
       break;
 
+    case TOKEN_PLAIN:
+      xfprintf (stderr, "plain:");
+      break;
+
     case TOKEN_WORD:
       xfprintf (stderr, "word:");
       break;
@@ -1147,7 +2396,8 @@ print_token (const char *s, token_type t, token_data *td)
       xfprintf (stderr, "eof\n");
       break;
     }
-  xfprintf (stderr, "\t\"%s\"\n", TOKEN_DATA_TEXT (td));
+  xfprintf (stderr, "\t\"%.*s\"\n", (int) TOKEN_DATA_LEN (td),
+            TOKEN_DATA_TEXT (td));
 }
 
 static void MAYBE_UNUSED
@@ -45,6 +45,15 @@ static _Noreturn void usage (int);
 /* Enable sync output for /lib/cpp (-s).  */
 int sync_output = 0;
 
+/* Compress diversions spilled to disk (--compress-diversions).  */
+int compress_diversions = 0;
+
+/* Print runtime statistics at exit (--stats).  */
+int show_stats = 0;
+
+/* Read input as UTF-8 text rather than bytes (--utf8).  */
+int utf8_mode = 0;
+
 /* Debug (-d[flags]).  */
 int debug_level = 0;
 
@@ -232,6 +241,9 @@ Operation modes:\n\
   -i, --interactive            unbuffer output, ignore interrupts\n\
   -P, --prefix-builtins        force a `m4_' prefix to all builtins\n\
   -Q, --quiet, --silent        suppress some warnings for builtins\n\
+      --utf8                   read input as UTF-8: non-ASCII letters in\n\
+                                 macro names, and len, index, substr and\n\
+                                 translit count characters\n\
 "), stdout);
       xprintf (_("\
       --warn-macro-sequence[=REGEXP]\n\
@@ -259,6 +271,9 @@ Limits control:\n\
   -H, --hashsize=PRIME         set symbol lookup hash table size [509]\n\
   -L, --nesting-limit=NUMBER   change nesting limit, 0 for unlimited [%d]\n\
 "), nesting_limit);
+      fputs (_("\
+      --compress-diversions    compress diversions spilled to disk\n\
+"), stdout);
       puts ("");
       fputs (_("\
 Frozen state files:\n\
@@ -273,6 +288,9 @@ Debugging:\n\
                                  (default stderr, discard if empty string)\n\
   -l, --arglength=NUM          restrict macro tracing size\n\
   -t, --trace=NAME             trace NAME when it is defined\n\
+      --trace-log=FILE         write tracing to FILE in compact binary form\n\
+      --trace-decode=FILE      print binary trace log FILE as text and exit\n\
+      --stats                  print runtime statistics on stderr at exit\n\
 "), stdout);
       puts ("");
       fputs (_("\
@@ -306,6 +324,23 @@ mismatch, or whatever value was passed to the m4exit macro.\n\
   exit (status);
 }
 
+/*-------------------------------------------------------------------.
+| Print the statistics gathered by each module, for --stats.  This   |
+| is an atexit handler.                                              |
+`-------------------------------------------------------------------*/
+
+static void
+print_stats (void)
+{
+  input_print_stats ();
+  macro_print_stats ();
+  symtab_print_stats ();
+  builtin_print_stats ();
+  case_print_stats ();
+  output_print_stats ();
+  freeze_print_stats ();
+}
+
 /*--------------------------------------.
 | Decode options and launch execution.  |
 `--------------------------------------*/
@@ -314,8 +349,13 @@ mismatch, or whatever value was passed to the m4exit macro.\n\
    non-character as a pseudo short option, starting with CHAR_MAX + 1.  */
 enum
 {
-  DEBUGFILE_OPTION = CHAR_MAX + 1,      /* no short opt */
+  COMPRESS_DIVERSIONS_OPTION = CHAR_MAX + 1, /* no short opt */
+  DEBUGFILE_OPTION,                     /* no short opt */
   DIVERSIONS_OPTION,                    /* not quite -N, because of message */
+  STATS_OPTION,                         /* no short opt */
+  TRACE_DECODE_OPTION,                  /* no short opt */
+  TRACE_LOG_OPTION,                     /* no short opt */
+  UTF8_OPTION,                          /* no short opt */
   WARN_MACRO_SEQUENCE_OPTION,           /* no short opt */
 
   HELP_OPTION,                          /* no short opt */
@@ -347,8 +387,13 @@ static const struct option long_options[] =
   {"word-regexp", required_argument, NULL, 'W'},
 #endif
 
+  {"compress-diversions", no_argument, NULL, COMPRESS_DIVERSIONS_OPTION},
   {"debugfile", optional_argument, NULL, DEBUGFILE_OPTION},
   {"diversions", required_argument, NULL, DIVERSIONS_OPTION},
+  {"stats", no_argument, NULL, STATS_OPTION},
+  {"trace-decode", required_argument, NULL, TRACE_DECODE_OPTION},
+  {"trace-log", required_argument, NULL, TRACE_LOG_OPTION},
+  {"utf8", no_argument, NULL, UTF8_OPTION},
   {"warn-macro-sequence", optional_argument, NULL, WARN_MACRO_SEQUENCE_OPTION},
 
   {"help", no_argument, NULL, HELP_OPTION},
@@ -412,6 +457,8 @@ main (int argc, char *const *argv)
   bool interactive = false;
   bool seen_file = false;
   const char *debugfile = NULL;
+  const char *trace_log_file = NULL;
+  const char *trace_file_to_decode = NULL;
   const char *frozen_file_to_read = NULL;
   const char *frozen_file_to_write = NULL;
   const char *macro_sequence = "";
@@ -604,6 +651,26 @@ main (int argc, char *const *argv)
         debugfile = optarg;
         break;
 
+      case TRACE_DECODE_OPTION:
+        trace_file_to_decode = optarg;
+        break;
+
+      case TRACE_LOG_OPTION:
+        trace_log_file = optarg;
+        break;
+
+      case COMPRESS_DIVERSIONS_OPTION:
+        compress_diversions = 1;
+        break;
+
+      case STATS_OPTION:
+        show_stats = 1;
+        break;
+
+      case UTF8_OPTION:
+        utf8_mode = 1;
+        break;
+
       case WARN_MACRO_SEQUENCE_OPTION:
          /* Don't call set_macro_sequence here, as it can exit.
             --warn-macro-sequence sets optarg to NULL (which uses the
@@ -624,10 +691,21 @@ main (int argc, char *const *argv)
 
   defines = head;
 
+  /* Decoding a trace log is a mode of its own.  */
+  if (trace_file_to_decode)
+    exit (trace_decode (trace_file_to_decode));
+
+  /* Registered after close_stdin, so that it runs first, even when
+     m4exit ends the run early.  */
+  if (show_stats)
+    atexit (print_stats);
+
   /* Do the basic initializations.  */
   if (debugfile && !debug_set_output (debugfile))
     M4ERROR ((warning_status, errno, _("cannot set debug file `%s'"),
               debugfile));
+  if (trace_log_file && !trace_log_open (trace_log_file))
+    m4_failure (errno, _("cannot create trace log `%s'"), trace_log_file);
 
   input_init ();
   output_init ();
@@ -635,6 +713,30 @@ main (int argc, char *const *argv)
   set_macro_sequence (macro_sequence);
   include_env_init ();
 
+  /* Now that the include path is known, let the system start reading
+     every input file named on the command line, so that later files
+     are already cached by the time earlier ones are expanded.  The
+     first file is opened right away, so hinting it would only cost
+     an extra open.  */
+  {
+    bool first = true;
+    int i;
+
+    for (defn = defines; defn != NULL; defn = defn->next)
+      if (defn->code == '\1')
+        {
+          if (!first && !STREQ (defn->arg, "-"))
+            m4_path_prefetch (defn->arg);
+          first = false;
+        }
+    for (i = optind; i < argc; i++)
+      {
+        if (!first && !STREQ (argv[i], "-"))
+          m4_path_prefetch (argv[i]);
+        first = false;
+      }
+  }
+
   if (frozen_file_to_read)
     reload_frozen_state (frozen_file_to_read);
   else
@@ -643,10 +745,8 @@ main (int argc, char *const *argv)
   /* Interactive mode means unbuffered output, and interrupts ignored.  */
 
   if (interactive)
-    {
-      signal (SIGINT, SIG_IGN);
-      setbuf (stdout, (char *) NULL);
-    }
+    signal (SIGINT, SIG_IGN);
+  output_set_buffering (interactive);
 
   /* Handle deferred command line macro definitions.  Must come after
      initialization of the symbol table.  */
@@ -717,6 +817,7 @@ main (int argc, char *const *argv)
 
   while (pop_wrapup ())
     expand_input ();
+  trace_log_close ();
 
   /* Change debug stream back to stderr, to force flushing the debug
      stream and detect any errors it might have encountered.  The
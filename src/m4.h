@@ -124,6 +124,9 @@ typedef unsigned int bool_bitfield;
 
 /* Option flags.  */
 extern int sync_output;                 /* -s */
+extern int compress_diversions;         /* --compress-diversions */
+extern int show_stats;                  /* --stats */
+extern int utf8_mode;                   /* --utf8 */
 extern int debug_level;                 /* -d */
 extern size_t hash_table_size;          /* -H */
 extern int no_gnu_extensions;           /* -G */
@@ -242,10 +245,15 @@ extern int debug_decode (const char *);
 extern void debug_flush_files (void);
 extern bool debug_set_output (const char *);
 extern void debug_message_prefix (void);
+extern void stats_message (const char *, ...)
+  ATTRIBUTE_FORMAT ((__printf__, 1, 2));
 
 extern void trace_prepre (const char *, int);
 extern void trace_pre (const char *, int, int, token_data **);
 extern void trace_post (const char *, int, int, const char *);
+extern bool trace_log_open (const char *);
+extern void trace_log_close (void);
+extern int trace_decode (const char *);
 
 /* File: input.c  --- lexical definitions.  */
 
@@ -259,6 +267,7 @@ enum token_type
   TOKEN_COMMA,                  /* , */
   TOKEN_CLOSE,                  /* ) */
   TOKEN_SIMPLE,                 /* any other single character */
+  TOKEN_PLAIN,                  /* a run of other characters */
   TOKEN_MACDEF                  /* a macro's definition (see "defn") */
 };
 
@@ -278,6 +287,7 @@ struct token_data
       struct
         {
           char *text;
+          size_t length;        /* length of text, from next_token () */
 #ifdef ENABLE_CHANGEWORD
           char *original_text;
 #endif
@@ -290,6 +300,7 @@ struct token_data
 
 #define TOKEN_DATA_TYPE(Td)             ((Td)->type)
 #define TOKEN_DATA_TEXT(Td)             ((Td)->u.u_t.text)
+#define TOKEN_DATA_LEN(Td)              ((Td)->u.u_t.length)
 #ifdef ENABLE_CHANGEWORD
 # define TOKEN_DATA_ORIG_TEXT(Td)       ((Td)->u.u_t.original_text)
 #endif
@@ -300,6 +311,12 @@ typedef enum token_data_type token_data_type;
 
 extern void input_init (void);
 extern token_type peek_token (void);
+/* The TOKEN_DATA_TEXT of a quoted string or plain run returned by
+   next_token () may point into the live INPUT_STRING block or file
+   buffer it was read from, and is then not NUL-terminated; use
+   TOKEN_DATA_LEN.  It must be consumed or copied before anything is
+   pushed on or popped off the input stack, and before the next call
+   to next_token ().  */
 extern token_type next_token (token_data *, int *);
 extern void skip_line (void);
 
@@ -308,8 +325,10 @@ extern void push_file (FILE *, const char *, bool);
 extern void push_macro (builtin_func *);
 extern struct obstack *push_string_init (void);
 extern const char *push_string_finish (void);
+extern const char *push_string_inert (size_t *);
 extern void push_wrapup (const char *);
 extern bool pop_wrapup (void);
+extern void input_print_stats (void);
 
 /* current input file, and line */
 extern const char *current_file;
@@ -338,11 +357,13 @@ extern int output_current_line;
 
 extern void output_init (void);
 extern void output_exit (void);
+extern void output_set_buffering (bool);
 extern void output_text (const char *, int);
 extern void shipout_text (struct obstack *, const char *, int, int);
 extern void make_diversion (int);
 extern void insert_diversion (int);
 extern void insert_file (FILE *);
+extern void output_print_stats (void);
 extern void freeze_diversions (FILE *);
 
 /* File symtab.c  --- symbol table definitions.  */
@@ -365,8 +386,11 @@ struct symbol
   bool_bitfield traced : 1;
   bool_bitfield macro_args : 1;
   bool_bitfield blind_no_args : 1;
+  bool_bitfield lazy_branches : 1;
   bool_bitfield deleted : 1;
   int pending_expansions;
+  size_t text_size;     /* storage for the definition text */
+  size_t text_length;   /* length of the definition text */
 
   size_t hash;
   char *name;
@@ -377,6 +401,7 @@ struct symbol
 #define SYMBOL_TRACED(S)        ((S)->traced)
 #define SYMBOL_MACRO_ARGS(S)    ((S)->macro_args)
 #define SYMBOL_BLIND_NO_ARGS(S) ((S)->blind_no_args)
+#define SYMBOL_LAZY_BRANCHES(S) ((S)->lazy_branches)
 #define SYMBOL_DELETED(S)       ((S)->deleted)
 #define SYMBOL_PENDING_EXPANSIONS(S) ((S)->pending_expansions)
 #define SYMBOL_NAME(S)          ((S)->name)
@@ -391,9 +416,16 @@ typedef void hack_symbol (symbol *, void *);
 #define HASHMAX 65537             /* default, overridden by -Hsize */
 
 extern void free_symbol (symbol *sym);
+extern void set_symbol_text (symbol *, const char *);
+extern char *append_symbol_text (symbol *, const char *);
+extern void offer_symbol_text (symbol *);
+extern char *intern_name (const char *);
+extern void release_name (char *);
+extern int32_t name_id (const char *);
 extern void symtab_init (void);
 extern symbol *lookup_symbol (const char *, symbol_lookup);
 extern void hack_all_symbols (hack_symbol *, void *);
+extern void symtab_print_stats (void);
 
 /* File: macro.c  --- macro expansion.  */
 
@@ -401,6 +433,7 @@ extern int expansion_level;
 
 extern void expand_input (void);
 extern void call_macro (symbol *, int, token_data **, struct obstack *);
+extern void macro_print_stats (void);
 
 /* File: builtin.c  --- builtins.  */
 
@@ -410,6 +443,7 @@ struct builtin
   bool_bitfield gnu_extension : 1;
   bool_bitfield groks_macro_args : 1;
   bool_bitfield blind_if_no_args : 1;
+  bool_bitfield lazy_branches : 1;
   builtin_func *func;
 };
 
@@ -444,6 +478,10 @@ extern const char *ntoa (int32_t, int);
 
 extern const builtin *find_builtin_by_addr (builtin_func *);
 extern const builtin *find_builtin_by_name (const char *);
+
+/* Number of regular expressions compiled, for --stats.  */
+extern uintmax_t regex_compile_count;
+extern void builtin_print_stats (void);
 
 /* File: path.c  --- path search for include files.  */
 
@@ -451,6 +489,7 @@ extern void include_init (void);
 extern void include_env_init (void);
 extern void add_include_directory (const char *);
 extern FILE *m4_path_search (const char *, char **);
+extern void m4_path_prefetch (const char *);
 
 /* File: eval.c  --- expression evaluation.  */
 
@@ -460,10 +499,18 @@ extern bool evaluate (const char *, int32_t *);
 
 extern void expand_format (struct obstack *, int, token_data **);
 
+/* File: casetab.c --- hashed case tables.  */
+
+extern void define_case_table (const char *, int, token_data **);
+extern void expand_case (struct obstack *, const char *, const char *);
+extern bool case_tables_defined (void);
+extern void case_print_stats (void);
+
 /* File: freeze.c --- frozen state files.  */
 
 extern void produce_frozen_state (const char *);
 extern void reload_frozen_state (const char *);
+extern void freeze_print_stats (void);
 
 /* Debugging the memory allocator.  */
 
@@ -24,7 +24,7 @@
 
 #include "m4.h"
 
-static void expand_macro (symbol *);
+static void expand_macro (symbol *, struct obstack *);
 static void expand_token (struct obstack *, token_type, token_data *, int);
 
 /* Current recursion level in expand_macro ().  */
@@ -44,12 +44,29 @@ static int macro_call_id = 0;
    hurt us too much.  */
 static struct obstack argc_stack;
 
+/* The local stacks for such nested calls.  Rather than initializing
+   and freeing an obstack for each call, which costs a chunk of memory
+   each time, the calls nested N deep within arguments that cannot use
+   argc_stack share the Nth stack of this pool, emptied again after
+   each call.  */
+static struct obstack **argument_pool;
+static size_t argument_pool_size;
+static size_t argument_pool_used;
+
 /* The shared stack of pointers to collected arguments for macro
    calls.  This object is never finished; we exploit the fact that
    obstack_blank_fast is documented to take a negative size to reduce
    the size again.  */
 static struct obstack argv_stack;
 
+/* Statistics for --stats.  The peak size of the argument stacks is
+   sampled whenever one of them grows a new chunk.  */
+static int max_expansion_level;
+static size_t argument_peak;
+static void *argc_chunk;
+static void *argv_chunk;
+static uintmax_t skipped_argument_count;
+
 /*----------------------------------------------------------------------.
 | This function read all input, and expands each token, one at a time.  |
 `----------------------------------------------------------------------*/
@@ -69,6 +86,17 @@ expand_input (void)
 
   obstack_free (&argc_stack, NULL);
   obstack_free (&argv_stack, NULL);
+  while (argument_pool_size > 0)
+    {
+      struct obstack *arguments = argument_pool[--argument_pool_size];
+      if (arguments != NULL)
+        {
+          obstack_free (arguments, NULL);
+          free (arguments);
+        }
+    }
+  free (argument_pool);
+  argument_pool = NULL;
 }
 
 
@@ -94,9 +122,9 @@ expand_token (struct obstack *obs, token_type t, token_data *td, int line)
     case TOKEN_COMMA:
     case TOKEN_CLOSE:
     case TOKEN_SIMPLE:
+    case TOKEN_PLAIN:
     case TOKEN_STRING:
-      shipout_text (obs, TOKEN_DATA_TEXT (td), strlen (TOKEN_DATA_TEXT (td)),
-                    line);
+      shipout_text (obs, TOKEN_DATA_TEXT (td), TOKEN_DATA_LEN (td), line);
       break;
 
     case TOKEN_WORD:
@@ -110,12 +138,11 @@ expand_token (struct obstack *obs, token_type t, token_data *td, int line)
           shipout_text (obs, TOKEN_DATA_ORIG_TEXT (td),
                         strlen (TOKEN_DATA_ORIG_TEXT (td)), line);
 #else
-          shipout_text (obs, TOKEN_DATA_TEXT (td),
-                        strlen (TOKEN_DATA_TEXT (td)), line);
+          shipout_text (obs, TOKEN_DATA_TEXT (td), TOKEN_DATA_LEN (td), line);
 #endif
         }
       else
-        expand_macro (sym);
+        expand_macro (sym, obs);
       break;
 
     default:
@@ -148,12 +175,24 @@ expand_argument (struct obstack *obs, token_data *argp)
 
   TOKEN_DATA_TYPE (argp) = TOKEN_VOID;
 
-  /* Skip leading white space.  */
+  /* Skip leading white space.  A run of plain text may start with
+     some, so drop that part, and go on if nothing is left.  */
   do
     {
       t = next_token (&td, NULL);
+      if (t == TOKEN_PLAIN)
+        {
+          text = TOKEN_DATA_TEXT (&td);
+          while (TOKEN_DATA_LEN (&td) && c_isspace (*text))
+            {
+              text++;
+              TOKEN_DATA_LEN (&td)--;
+            }
+          TOKEN_DATA_TEXT (&td) = text;
+        }
     }
-  while (t == TOKEN_SIMPLE && c_isspace (*TOKEN_DATA_TEXT (&td)));
+  while ((t == TOKEN_SIMPLE && c_isspace (*TOKEN_DATA_TEXT (&td)))
+         || (t == TOKEN_PLAIN && TOKEN_DATA_LEN (&td) == 0));
 
   paren_level = 0;
 
@@ -197,6 +236,7 @@ expand_argument (struct obstack *obs, token_data *argp)
 
         case TOKEN_WORD:
         case TOKEN_STRING:
+        case TOKEN_PLAIN:
           expand_token (obs, t, &td, line);
           break;
 
@@ -218,11 +258,71 @@ expand_argument (struct obstack *obs, token_data *argp)
     }
 }
 
-/*-------------------------------------------------------------.
-| Collect all the arguments to a call of the macro SYM.  The   |
-| arguments are stored on the obstack ARGUMENTS and a table of |
-| pointers to the arguments on the obstack ARGPTR.             |
-`-------------------------------------------------------------*/
+/*-------------------------------------------------------------------.
+| Like expand_argument (), but read the argument without expanding   |
+| it, and discard it.  Only the tokens needed to find its end matter |
+| here, so words are not even looked up.                             |
+`-------------------------------------------------------------------*/
+
+static bool
+skip_argument (void)
+{
+  token_type t;
+  token_data td;
+  const char *text;
+  int paren_level = 0;
+  const char *file = current_file;
+  int line = current_line;
+
+  skipped_argument_count++;
+  while (1)
+    {
+      t = next_token (&td, NULL);
+      switch (t)
+        { /* TOKSW */
+        case TOKEN_COMMA:
+        case TOKEN_CLOSE:
+          if (paren_level == 0)
+            return t == TOKEN_COMMA;
+          FALLTHROUGH;
+        case TOKEN_OPEN:
+        case TOKEN_SIMPLE:
+          text = TOKEN_DATA_TEXT (&td);
+          if (*text == '(')
+            paren_level++;
+          else if (*text == ')')
+            paren_level--;
+          break;
+
+        case TOKEN_EOF:
+          m4_failure_at_line (0, file, line,
+                              _("ERROR: end of file in argument list"));
+
+        case TOKEN_WORD:
+        case TOKEN_STRING:
+        case TOKEN_PLAIN:
+        case TOKEN_MACDEF:
+          break;
+
+        default:
+          M4ERROR ((warning_status, 0,
+                    "INTERNAL ERROR: bad token type in skip_argument ()"));
+          abort ();
+        }
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Collect all the arguments to a call of the macro SYM.  The         |
+| arguments are stored on the obstack ARGUMENTS and a table of       |
+| pointers to the arguments on the obstack ARGPTR.                   |
+|                                                                    |
+| For a builtin with lazy branches, such as ifcase, the arguments    |
+| are taken as ifelse takes them, in groups of three.  A branch is   |
+| only expanded when the two arguments before it are equal, and once |
+| one is, the remaining arguments are skipped.  Skipped arguments    |
+| are passed as empty strings.                                       |
+`-------------------------------------------------------------------*/
 
 static void
 collect_arguments (symbol *sym, struct obstack *argptr,
@@ -232,6 +332,12 @@ collect_arguments (symbol *sym, struct obstack *argptr,
   token_data *tdp;
   bool more_args;
   bool groks_macro_args = SYMBOL_MACRO_ARGS (sym);
+  bool lazy = (SYMBOL_TYPE (sym) == TOKEN_FUNC
+               && SYMBOL_LAZY_BRANCHES (sym));
+  bool selected = false;
+  const char *left = NULL;      /* the argument two before this one */
+  const char *right = NULL;     /* the argument just before this one */
+  int i = 0;
 
   TOKEN_DATA_TYPE (&td) = TOKEN_TEXT;
   TOKEN_DATA_TEXT (&td) = SYMBOL_NAME (sym);
@@ -243,13 +349,30 @@ collect_arguments (symbol *sym, struct obstack *argptr,
       next_token (&td, NULL); /* gobble parenthesis */
       do
         {
-          more_args = expand_argument (arguments, &td);
+          i++;
+          if (lazy && (selected || (i % 3 == 0 && !STREQ (left, right))))
+            {
+              more_args = skip_argument ();
+              TOKEN_DATA_TYPE (&td) = TOKEN_TEXT;
+              TOKEN_DATA_TEXT (&td) = (char *) "";
+            }
+          else
+            {
+              more_args = expand_argument (arguments, &td);
+              if (lazy && i % 3 == 0)
+                selected = true;
+            }
 
           if (!groks_macro_args && TOKEN_DATA_TYPE (&td) == TOKEN_FUNC)
             {
               TOKEN_DATA_TYPE (&td) = TOKEN_TEXT;
               TOKEN_DATA_TEXT (&td) = (char *) "";
             }
+          if (lazy)
+            {
+              left = right;
+              right = TOKEN_DATA_TEXT (&td);
+            }
           tdp = (token_data *) obstack_copy (arguments, &td, sizeof td);
           obstack_ptr_grow (argptr, tdp);
         }
@@ -294,24 +417,32 @@ call_macro (symbol *sym, int argc, token_data **argv,
 | The macro expansion is handled by expand_macro ().  It parses the  |
 | arguments, using collect_arguments (), and builds a table of       |
 | pointers to the arguments.  The arguments themselves are stored on |
-| a local obstack.  Expand_macro () uses call_macro () to do the     |
-| call of the macro.                                                 |
+| argc_stack, or on one from argument_pool when argc_stack is busy.  |
+| Expand_macro () uses call_macro () to do the call of the macro.    |
+| The expansion is pushed back on the input to be rescanned, unless  |
+| rescanning could not change it; then it goes straight to OBS, as   |
+| expand_token () would send the text of a token.                    |
 |                                                                    |
 | Expand_macro () is potentially recursive, since it calls           |
 | expand_argument (), which might call expand_token (), which might  |
-| call expand_macro ().                                              |
+| call expand_macro ().  The expansion itself is rescanned only      |
+| after expand_macro () has returned, so a macro that calls itself   |
+| at the end of its expansion does not recurse here; and as          |
+| push_string_init () pops exhausted strings first, such a loop runs |
+| in constant space.                                                 |
 `-------------------------------------------------------------------*/
 
 static void
-expand_macro (symbol *sym)
+expand_macro (symbol *sym, struct obstack *obs)
 {
-  struct obstack arguments;     /* Alternate obstack if argc_stack is busy.  */
+  struct obstack *arguments;    /* argc_stack, unless it is busy.  */
   unsigned argv_base;           /* Size of argv_stack on entry.  */
-  bool use_argc_stack = true;   /* Whether argc_stack is safe.  */
   token_data **argv;
   int argc;
   struct obstack *expansion;
   const char *expanded;
+  const char *inert;
+  size_t inert_length;
   bool traced;
   int my_call_id;
 
@@ -331,6 +462,8 @@ expand_macro (symbol *sym)
   if (nesting_limit > 0 && expansion_level > nesting_limit)
     m4_failure (0, _("recursion limit of %d exceeded, use -L<N> to change it"),
                 nesting_limit);
+  if (expansion_level > max_expansion_level)
+    max_expansion_level = expansion_level;
 
   macro_call_id++;
   my_call_id = macro_call_id;
@@ -338,25 +471,50 @@ expand_macro (symbol *sym)
   traced = (debug_level & DEBUG_TRACE_ALL) || SYMBOL_TRACED (sym);
 
   argv_base = obstack_object_size (&argv_stack);
+  arguments = &argc_stack;
   if (obstack_object_size (&argc_stack) > 0)
     {
       /* We cannot use argc_stack if this is a nested invocation, and an
          outer invocation has an unfinished argument being
          collected.  */
-      obstack_init (&arguments);
-      use_argc_stack = false;
+      if (argument_pool_used == argument_pool_size)
+        {
+          size_t old_size = argument_pool_size;
+          argument_pool = x2nrealloc (argument_pool, &argument_pool_size,
+                                      sizeof *argument_pool);
+          memset (argument_pool + old_size, 0,
+                  (argument_pool_size - old_size) * sizeof *argument_pool);
+        }
+      arguments = argument_pool[argument_pool_used];
+      if (arguments == NULL)
+        {
+          arguments = (struct obstack *) xmalloc (sizeof *arguments);
+          obstack_init (arguments);
+          argument_pool[argument_pool_used] = arguments;
+        }
+      argument_pool_used++;
     }
 
   if (traced && (debug_level & DEBUG_TRACE_CALL))
     trace_prepre (SYMBOL_NAME (sym), my_call_id);
 
-  collect_arguments (sym, &argv_stack,
-                     use_argc_stack ? &argc_stack : &arguments);
+  collect_arguments (sym, &argv_stack, arguments);
 
   argc = ((obstack_object_size (&argv_stack) - argv_base)
           / sizeof (token_data *));
   argv = (token_data **) ((uintptr_t) obstack_base (&argv_stack) + argv_base);
 
+  if (show_stats && (argc_stack.chunk != argc_chunk
+                     || argv_stack.chunk != argv_chunk))
+    {
+      size_t size = (obstack_memory_used (&argc_stack)
+                     + obstack_memory_used (&argv_stack));
+      argc_chunk = argc_stack.chunk;
+      argv_chunk = argv_stack.chunk;
+      if (size > argument_peak)
+        argument_peak = size;
+    }
+
   loc_close_file = current_file;
   loc_close_line = current_line;
   current_file = loc_open_file;
@@ -367,7 +525,10 @@ expand_macro (symbol *sym)
 
   expansion = push_string_init ();
   call_macro (sym, argc, argv, expansion);
-  expanded = push_string_finish ();
+  /* Sync lines are decided token by token, so with -s the expansion
+     is always rescanned.  */
+  inert = sync_output ? NULL : push_string_inert (&inert_length);
+  expanded = inert ? inert : push_string_finish ();
 
   if (traced)
     trace_post (SYMBOL_NAME (sym), my_call_id, argc, expanded);
@@ -381,9 +542,31 @@ expand_macro (symbol *sym)
   if (SYMBOL_DELETED (sym))
     free_symbol (sym);
 
-  if (use_argc_stack)
-    obstack_free (&argc_stack, argv[0]);
-  else
-    obstack_free (&arguments, NULL);
+  obstack_free (arguments, argv[0]);
+  if (arguments != &argc_stack)
+    argument_pool_used--;
   obstack_blank_fast (&argv_stack, -argc * sizeof (token_data *));
+
+  /* An expansion that rescanning would pass through unchanged, such
+     as a number, goes straight to where its tokens would have gone.
+     This must wait until the arguments are released, as OBS may be
+     the obstack they were collected on.  */
+  if (inert)
+    {
+      shipout_text (obs, inert, inert_length, current_line);
+      push_string_finish ();
+    }
+}
+
+/*---------------------------------------.
+| Print macro statistics, for --stats.   |
+`---------------------------------------*/
+
+void
+macro_print_stats (void)
+{
+  stats_message ("macros: %d calls, maximum expansion level %d, "
+                 "argument stack peak %zu bytes, %ju arguments skipped",
+                 macro_call_id, max_expansion_level, argument_peak,
+                 skipped_argument_count);
 }
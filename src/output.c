@@ -23,6 +23,7 @@
 
 #include <limits.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include "gl_avltree_oset.h"
 #include "gl_xoset.h"
@@ -36,7 +37,19 @@
 #define MAXIMUM_TOTAL_SIZE (512 * 1024)
 
 /* Size of buffer size to use while copying files.  */
-#define COPY_BUFFER_SIZE (32 * 512)
+#define COPY_BUFFER_SIZE (128 * 512)
+
+/* Size of the stdio buffer for standard output, when it is not a
+   terminal.  */
+#define STDOUT_BUFFER_SIZE (128 * 1024)
+
+/* Largest amount of diversion text compressed as a single block when
+   spilling with --compress-diversions.  Must not exceed 64 KiB, so
+   that every back-reference fits in two bytes.  */
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+
+/* Upper bound on the compressed size of a block of LENGTH bytes.  */
+#define COMPRESS_BOUND(Length) ((Length) + (Length) / 255 + 16)
 
 /* Output functions.  Most of the complexity is for handling cpp like
    sync lines.
@@ -51,7 +64,12 @@ typedef struct temp_dir m4_temp_dir;
    buffer (non-zero size, non-NULL u.buffer), or an unused placeholder
    diversion (zero size, u is NULL, non-zero used indicates that a
    file has been created).  When not part of diversion_table, u.next
-   is a pointer to the free_list chain.  */
+   is a pointer to the free_list chain.
+
+   With --compress-diversions, a diversion never becomes an open
+   file.  Instead, non-zero spilled counts the bytes that were
+   compressed into its temporary file; they logically precede
+   whatever the in-memory buffer (if any) currently holds.  */
 
 typedef struct m4_diversion m4_diversion;
 
@@ -66,6 +84,7 @@ struct m4_diversion
     int divnum;                 /* Which diversion this represents.  */
     int size;                   /* Usable size before reallocation.  */
     int used;                   /* Used buffer length, or tmp file exists.  */
+    off_t spilled;              /* Uncompressed length of tmp file.  */
   };
 
 /* Table of diversions 1 through INT_MAX.  */
@@ -124,6 +143,20 @@ static int tmp_file2_owner;
 /* True if tmp_file2 is more recently used.  */
 static bool tmp_file2_recent;
 
+/* Statistics for --stats: diversions spilled to disk, spilled
+   diversions read back, and bytes copied while undiverting.  */
+static uintmax_t spill_count;
+static uintmax_t spill_bytes;
+static uintmax_t reload_count;
+static uintmax_t copied_bytes;
+
+/* Statistics on compressed spills, also reported by --stats.  */
+static uintmax_t compress_raw_bytes;
+static uintmax_t compress_packed_bytes;
+static uintmax_t compress_blocks;
+static clock_t compress_time;
+static clock_t decompress_time;
+
 
 /* Internal routines.  */
 
@@ -365,6 +398,305 @@ m4_tmprename (int oldnum, int newnum)
   return m4_tmpopen (newnum, false);
 }
 
+
+/* Compression of spilled diversions.  The codec is a small LZ77
+   variant using the LZ4 block layout: each sequence is a token byte
+   holding a literal count and a match length (each nibble extended
+   by 255-valued bytes when saturated), the literals, then a two byte
+   little-endian offset back into the already decoded text.  The last
+   sequence of a block has literals only.  It trades ratio for speed,
+   which is what matters when the alternative is plain disk I/O.  */
+
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+
+/* Return the 4 bytes at P as an integer in host order.  */
+static inline uint32_t
+lz_read32 (const unsigned char *p)
+{
+  uint32_t value;
+  memcpy (&value, p, sizeof value);
+  return value;
+}
+
+/* Emit LENGTH as the continuation of a saturated token nibble.  */
+static unsigned char *
+lz_put_length (unsigned char *out, size_t length)
+{
+  for (; length >= 255; length -= 255)
+    *out++ = 255;
+  *out++ = length;
+  return out;
+}
+
+/*------------------------------------------------------------------.
+| Compress LENGTH bytes at SRC into DST, which must have room for   |
+| COMPRESS_BOUND (LENGTH) bytes.  LENGTH must not exceed            |
+| COMPRESS_BLOCK_SIZE.  Return the compressed size.                 |
+`------------------------------------------------------------------*/
+
+static size_t
+lz_compress (const char *src, size_t length, char *dst)
+{
+  static int table[1 << LZ_HASH_BITS];
+  const unsigned char *base = (const unsigned char *) src;
+  const unsigned char *end = base + length;
+  const unsigned char *anchor = base;
+  const unsigned char *ip = base;
+  unsigned char *out = (unsigned char *) dst;
+  size_t literals;
+
+  /* Positions are stored biased by one, so zero means empty.  */
+  memset (table, 0, sizeof table);
+  while (ip + LZ_MIN_MATCH <= end)
+    {
+      uint32_t sequence = lz_read32 (ip);
+      unsigned int hash = ((sequence * 2654435761U)
+                           >> (32 - LZ_HASH_BITS));
+      const unsigned char *ref = base + table[hash] - 1;
+      bool found = table[hash] != 0 && lz_read32 (ref) == sequence;
+      table[hash] = ip - base + 1;
+      if (found)
+        {
+          const unsigned char *match = ip + LZ_MIN_MATCH;
+          size_t offset = ip - ref;
+          size_t match_length;
+          unsigned char *token = out++;
+
+          while (match < end && *match == ref[match - ip])
+            match++;
+          match_length = match - ip - LZ_MIN_MATCH;
+          literals = ip - anchor;
+
+          *token = ((literals < 15 ? literals : 15) << 4
+                    | (match_length < 15 ? match_length : 15));
+          if (literals >= 15)
+            out = lz_put_length (out, literals - 15);
+          memcpy (out, anchor, literals);
+          out += literals;
+          *out++ = offset & 0xff;
+          *out++ = offset >> 8;
+          if (match_length >= 15)
+            out = lz_put_length (out, match_length - 15);
+          ip = anchor = match;
+        }
+      else
+        /* Skip faster through text that does not compress.  */
+        ip += 1 + ((ip - anchor) >> 6);
+    }
+
+  literals = end - anchor;
+  *out++ = (literals < 15 ? literals : 15) << 4;
+  if (literals >= 15)
+    out = lz_put_length (out, literals - 15);
+  memcpy (out, anchor, literals);
+  out += literals;
+  return out - (unsigned char *) dst;
+}
+
+/*------------------------------------------------------------------.
+| Expand the SRC_LENGTH bytes of compressed data at SRC into DST,   |
+| which must decode to exactly DST_LENGTH bytes.  Return false if   |
+| the data is corrupt.                                              |
+`------------------------------------------------------------------*/
+
+static bool
+lz_decompress (const char *src, size_t src_length, char *dst,
+               size_t dst_length)
+{
+  const unsigned char *ip = (const unsigned char *) src;
+  const unsigned char *ip_end = ip + src_length;
+  unsigned char *out = (unsigned char *) dst;
+  unsigned char *out_end = out + dst_length;
+
+  while (ip < ip_end)
+    {
+      unsigned int token = *ip++;
+      size_t length = token >> 4;
+      size_t offset;
+      unsigned char byte;
+
+      if (length == 15)
+        do
+          {
+            if (ip == ip_end)
+              return false;
+            byte = *ip++;
+            length += byte;
+          }
+        while (byte == 255);
+      if (length > (size_t) (ip_end - ip)
+          || length > (size_t) (out_end - out))
+        return false;
+      memcpy (out, ip, length);
+      ip += length;
+      out += length;
+      if (ip == ip_end)
+        break;
+
+      if (ip_end - ip < 2)
+        return false;
+      offset = ip[0] | ip[1] << 8;
+      ip += 2;
+      length = token & 15;
+      if (length == 15)
+        do
+          {
+            if (ip == ip_end)
+              return false;
+            byte = *ip++;
+            length += byte;
+          }
+        while (byte == 255);
+      length += LZ_MIN_MATCH;
+      if (offset == 0 || offset > (size_t) (out - (unsigned char *) dst)
+          || length > (size_t) (out_end - out))
+        return false;
+      /* The source may overlap the destination, so copy forward.  */
+      for (; length > 0; length--, out++)
+        *out = out[-offset];
+    }
+  return out == out_end;
+}
+
+/* Write the header of a spilled block to FILE: the RAW and PACKED
+   sizes, each as four little-endian bytes.  */
+static void
+put_block_header (FILE *file, size_t raw, size_t packed)
+{
+  unsigned char header[8];
+  int i;
+
+  for (i = 0; i < 4; i++)
+    {
+      header[i] = raw >> (8 * i);
+      header[i + 4] = packed >> (8 * i);
+    }
+  if (fwrite (header, sizeof header, 1, file) != 1)
+    m4_failure (errno, _("ERROR: cannot flush diversion to temporary file"));
+}
+
+/*-----------------------------------------------------------------.
+| Compress the in-memory buffer of DIVERSION onto the end of its   |
+| temporary file, and release the buffer.  Blocks that do not      |
+| shrink are stored as is, flagged by equal raw and packed sizes.  |
+`-----------------------------------------------------------------*/
+
+static void
+spill_compressed (m4_diversion *diversion)
+{
+  static char packed[COMPRESS_BOUND (COMPRESS_BLOCK_SIZE)];
+  FILE *file;
+  clock_t start;
+  int offset;
+
+  if (diversion->used > 0)
+    {
+      spill_count++;
+      spill_bytes += diversion->used;
+      if (diversion->spilled)
+        file = m4_tmpopen (diversion->divnum, false);
+      else
+        file = m4_tmpfile (diversion->divnum);
+
+      for (offset = 0; offset < diversion->used;
+           offset += COMPRESS_BLOCK_SIZE)
+        {
+          const char *raw = diversion->u.buffer + offset;
+          size_t raw_length = diversion->used - offset;
+          size_t packed_length;
+
+          if (raw_length > COMPRESS_BLOCK_SIZE)
+            raw_length = COMPRESS_BLOCK_SIZE;
+          start = clock ();
+          packed_length = lz_compress (raw, raw_length, packed);
+          compress_time += clock () - start;
+          if (packed_length >= raw_length)
+            {
+              packed_length = raw_length;
+              raw = memcpy (packed, raw, raw_length);
+            }
+          put_block_header (file, raw_length, packed_length);
+          if (fwrite (packed, packed_length, 1, file) != 1)
+            m4_failure (errno,
+                        _("ERROR: cannot flush diversion to temporary file"));
+          compress_raw_bytes += raw_length;
+          compress_packed_bytes += packed_length + 8;
+          compress_blocks++;
+        }
+
+      diversion->spilled += diversion->used;
+      if (m4_tmpclose (file, diversion->divnum) != 0)
+        m4_error (0, errno, _("cannot close temporary file for diversion"));
+    }
+
+  total_buffer_size -= diversion->size;
+  free (diversion->u.buffer);
+  diversion->u.buffer = NULL;
+  diversion->size = 0;
+  diversion->used = 0;
+}
+
+/*-----------------------------------------------------------------.
+| Decompress the temporary file of DIVERSION into the current      |
+| output.  The file is closed but not removed.  The file is kept   |
+| out of the tmp_file cache while reading, since output_text may   |
+| spill other diversions and recycle cache entries.                |
+`-----------------------------------------------------------------*/
+
+static void
+insert_compressed (m4_diversion *diversion)
+{
+  static char raw[COMPRESS_BLOCK_SIZE];
+  static char packed[COMPRESS_BLOCK_SIZE];
+  unsigned char header[8];
+  FILE *file = m4_tmpopen (diversion->divnum, true);
+  off_t remaining = diversion->spilled;
+  clock_t start;
+
+  reload_count++;
+  copied_bytes += remaining;
+
+  if (tmp_file1_owner == diversion->divnum)
+    tmp_file1_owner = 0;
+  else if (tmp_file2_owner == diversion->divnum)
+    tmp_file2_owner = 0;
+
+  while (remaining > 0)
+    {
+      size_t raw_length = 0;
+      size_t packed_length = 0;
+      int i;
+
+      if (fread (header, sizeof header, 1, file) != 1)
+        m4_failure (errno, _("error reading inserted file"));
+      for (i = 3; i >= 0; i--)
+        {
+          raw_length = raw_length << 8 | header[i];
+          packed_length = packed_length << 8 | header[i + 4];
+        }
+      if (raw_length == 0 || raw_length > COMPRESS_BLOCK_SIZE
+          || packed_length > raw_length || (off_t) raw_length > remaining)
+        m4_failure (0, _("corrupt temporary file for diversion"));
+      if (fread (packed, packed_length, 1, file) != 1)
+        m4_failure (errno, _("error reading inserted file"));
+      if (packed_length == raw_length)
+        output_text (packed, raw_length);
+      else
+        {
+          start = clock ();
+          if (!lz_decompress (packed, packed_length, raw, raw_length))
+            m4_failure (0, _("corrupt temporary file for diversion"));
+          decompress_time += clock () - start;
+          output_text (raw, raw_length);
+        }
+      remaining -= raw_length;
+    }
+
+  if (close_stream_temp (file) != 0)
+    m4_error (0, errno, _("cannot clean temporary file for diversion"));
+}
+
 
 /*------------------------.
 | Output initialization.  |
@@ -381,12 +713,31 @@ output_init (void)
   obstack_init (&diversion_storage);
 }
 
+/*-------------------------------------------------------------------.
+| Set up buffering of standard output.  If INTERACTIVE, output is    |
+| unbuffered.  Otherwise, unless stdout is a terminal, use a buffer  |
+| much larger than the stdio default, so that output reaches slow    |
+| pipes and disks in few large writes.  Explicit flushes, such as    |
+| the one before syscmd, still happen at the same points.            |
+`-------------------------------------------------------------------*/
+
+void
+output_set_buffering (bool interactive)
+{
+  if (interactive)
+    setbuf (stdout, NULL);
+  else if (!isatty (STDOUT_FILENO))
+    setvbuf (stdout, xcharalloc (STDOUT_BUFFER_SIZE), _IOFBF,
+             STDOUT_BUFFER_SIZE);
+}
+
 void
 output_exit (void)
 {
   /* Order is important, since we may have registered cleanup_tmpfile
      as an atexit handler, and it must not traverse stale memory.  */
   gl_oset_t table = diversion_table;
+
   if (tmp_file1_owner)
     m4_tmpremove (tmp_file1_owner);
   if (tmp_file2_owner)
@@ -396,6 +747,26 @@ output_exit (void)
   obstack_free (&diversion_storage, NULL);
 }
 
+/*-------------------------------------------.
+| Print diversion statistics, for --stats.   |
+`-------------------------------------------*/
+
+void
+output_print_stats (void)
+{
+  stats_message ("diversions: %ju spills of %ju bytes, %ju reloads, "
+                 "%ju bytes undiverted", spill_count, spill_bytes,
+                 reload_count, copied_bytes);
+  if (compress_blocks)
+    stats_message ("compression: %ju bytes in %ju blocks, %ju bytes "
+                   "written (%.1f%%), %.3fs compressing, "
+                   "%.3fs decompressing", compress_raw_bytes,
+                   compress_blocks, compress_packed_bytes,
+                   100.0 * compress_packed_bytes / compress_raw_bytes,
+                   (double) compress_time / CLOCKS_PER_SEC,
+                   (double) decompress_time / CLOCKS_PER_SEC);
+}
+
 /*----------------------------------------------------------------.
 | Reorganize in-memory diversion buffers so the current diversion |
 | can accomodate LENGTH more characters without further           |
@@ -455,31 +826,51 @@ make_room_for (int length)
         }
       gl_oset_iterator_free (&iter);
 
-      /* Create a temporary file, write the in-memory buffer of the
-         diversion to this file, then release the buffer.  Zero the
-         diversion before doing anything that can exit () (including
-         m4_tmpfile), so that the atexit handler doesn't try to close
-         a garbage pointer as a file.  */
-
-      selected_buffer = selected_diversion->u.buffer;
-      total_buffer_size -= selected_diversion->size;
-      selected_diversion->size = 0;
-      selected_diversion->u.file = NULL;
-      selected_diversion->u.file = m4_tmpfile (selected_diversion->divnum);
+      /* In compressed mode, the selected diversion keeps collecting
+         output in memory after its buffer is packed away, so the
+         current diversion merely has to size its buffer anew.  */
 
-      if (selected_diversion->used > 0)
+      if (compress_diversions)
         {
-          count = fwrite (selected_buffer, (size_t) selected_diversion->used,
-                          1, selected_diversion->u.file);
-          if (count != 1)
-            m4_failure (errno,
-                        _("ERROR: cannot flush diversion to temporary file"));
+          spill_compressed (selected_diversion);
+          if (selected_diversion == output_diversion)
+            for (wanted_size = INITIAL_BUFFER_SIZE; wanted_size < length;
+                 wanted_size *= 2)
+              ;
+          selected_diversion = NULL;
         }
+      else
+        {
+          /* Create a temporary file, write the in-memory buffer of the
+             diversion to this file, then release the buffer.  Zero the
+             diversion before doing anything that can exit () (including
+             m4_tmpfile), so that the atexit handler doesn't try to close
+             a garbage pointer as a file.  */
+
+          selected_buffer = selected_diversion->u.buffer;
+          total_buffer_size -= selected_diversion->size;
+          selected_diversion->size = 0;
+          selected_diversion->u.file = NULL;
+          selected_diversion->u.file
+            = m4_tmpfile (selected_diversion->divnum);
 
-      /* Reclaim the buffer space for other diversions.  */
+          if (selected_diversion->used > 0)
+            {
+              spill_count++;
+              spill_bytes += selected_diversion->used;
+              count = fwrite (selected_buffer,
+                              (size_t) selected_diversion->used, 1,
+                              selected_diversion->u.file);
+              if (count != 1)
+                m4_failure (errno, _("ERROR: cannot flush diversion "
+                                     "to temporary file"));
+            }
+
+          /* Reclaim the buffer space for other diversions.  */
 
-      free (selected_buffer);
-      selected_diversion->used = 1;
+          free (selected_buffer);
+          selected_diversion->used = 1;
+        }
     }
 
   /* Reload output_file, just in case the flushed diversion was current.  */
@@ -717,7 +1108,8 @@ make_diversion (int divnum)
 
   if (output_diversion)
     {
-      if (!output_diversion->size && !output_diversion->u.file)
+      if (!output_diversion->size && !output_diversion->u.file
+          && !output_diversion->spilled)
         {
           assert (!output_diversion->used);
           if (!gl_oset_remove (diversion_table, output_diversion))
@@ -773,6 +1165,7 @@ make_diversion (int divnum)
                                                       sizeof *diversion);
           diversion->size = 0;
           diversion->used = 0;
+          diversion->spilled = 0;
         }
       diversion->u.file = NULL;
       diversion->divnum = divnum;
@@ -819,6 +1212,7 @@ insert_file (FILE *file)
         m4_failure (errno, _("error reading inserted file"));
       if (length == 0)
         break;
+      copied_bytes += length;
       output_text (buffer, length);
     }
 }
@@ -836,7 +1230,24 @@ insert_diversion_helper (m4_diversion *diversion)
   /* Effectively undivert only if an output stream is active.  */
   if (output_diversion)
     {
-      if (diversion->size)
+      if (diversion->spilled)
+        {
+          /* Detach the in-memory tail first, so that output_text
+             cannot pick it for spilling while the compressed part is
+             being copied.  */
+          char *buffer = diversion->u.buffer;
+          int used = diversion->used;
+          total_buffer_size -= diversion->size;
+          diversion->u.buffer = NULL;
+          diversion->size = 0;
+          diversion->used = 0;
+          insert_compressed (diversion);
+          copied_bytes += used;
+          if (used)
+            output_text (buffer, used);
+          free (buffer);
+        }
+      else if (diversion->size)
         {
           if (!output_diversion->u.file)
             {
@@ -856,6 +1267,7 @@ insert_diversion_helper (m4_diversion *diversion)
                  transferring from one in-memory diversion to
                  another.  */
               total_buffer_size -= diversion->size;
+              copied_bytes += diversion->used;
               output_text (diversion->u.buffer, diversion->used);
             }
         }
@@ -876,6 +1288,7 @@ insert_diversion_helper (m4_diversion *diversion)
         {
           if (!diversion->u.file)
             diversion->u.file = m4_tmpopen (diversion->divnum, true);
+          reload_count++;
           insert_file (diversion->u.file);
         }
 
@@ -883,7 +1296,19 @@ insert_diversion_helper (m4_diversion *diversion)
     }
 
   /* Return all space used by the diversion.  */
-  if (diversion->size)
+  if (diversion->spilled)
+    {
+      if (diversion->size)
+        {
+          total_buffer_size -= diversion->size;
+          free (diversion->u.buffer);
+          diversion->size = 0;
+        }
+      if (m4_tmpremove (diversion->divnum) != 0)
+        M4ERROR ((0, errno, _("cannot clean temporary file for diversion")));
+      diversion->spilled = 0;
+    }
+  else if (diversion->size)
     {
       if (!output_diversion)
         total_buffer_size -= diversion->size;
@@ -974,9 +1399,16 @@ freeze_diversions (FILE *file)
   while (gl_oset_iterator_next (&iter, &elt))
     {
       m4_diversion *diversion = (m4_diversion *) elt;
-      if (diversion->size || diversion->used)
+      if (diversion->size || diversion->used || diversion->spilled)
         {
-          if (diversion->size)
+          if (diversion->spilled)
+            {
+              uintmax_t length = diversion->spilled;
+              if (diversion->size)
+                length += diversion->used;
+              xfprintf (file, "D%d,%ju\n", diversion->divnum, length);
+            }
+          else if (diversion->size)
             xfprintf (file, "D%d,%d\n", diversion->divnum, diversion->used);
           else
             {
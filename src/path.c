@@ -24,6 +24,8 @@
 
 #include "m4.h"
 
+#include <fcntl.h>
+
 struct includes
 {
   struct includes *next;        /* next directory to search */
@@ -121,10 +123,42 @@ m4_fopen (const char *file)
           errno = EISDIR;
           return NULL;
         }
+#ifdef HAVE_POSIX_FADVISE
+      /* Input is read once, front to back; let the system read ahead
+         more aggressively.  */
+      if (S_ISREG (st.st_mode))
+        posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
     }
   return fp;
 }
 
+#ifdef HAVE_POSIX_FADVISE
+/* Ask the system to start reading FILE in the background, if it
+   exists and is not a directory.  Return true if the file exists.  */
+static bool
+m4_prefetch (const char *file)
+{
+  struct stat st;
+  int fd;
+
+  /* Check before opening, since opening a fifo would interfere with
+     its writer.  */
+  if (stat (file, &st) != 0 || S_ISDIR (st.st_mode))
+    return false;
+  if (S_ISREG (st.st_mode))
+    {
+      fd = open (file, O_RDONLY);
+      if (fd >= 0)
+        {
+          posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+          close (fd);
+        }
+    }
+  return true;
+}
+#endif /* HAVE_POSIX_FADVISE */
+
 /* Search for FILE, first in `.', then according to -I options.  If
    successful, return the open file, and if RESULT is not NULL, set
    *RESULT to a malloc'd string that represents the file found with
@@ -187,6 +221,36 @@ m4_path_search (const char *file, char **result)
   return fp;
 }
 
+/* Locate FILE the way m4_path_search would, and ask the system to
+   read it into its cache in the background, so that the data is
+   ready by the time FILE is actually processed.  This is a hint
+   only; nothing is reported, whether FILE is found or not.  Files
+   that are not regular, such as pipes, are left alone.  */
+
+void
+m4_path_prefetch (const char *file)
+{
+#ifdef HAVE_POSIX_FADVISE
+  includes *incl;
+  char *name;
+  bool found;
+
+  if (!*file || m4_prefetch (file))
+    return;
+  if (IS_ABSOLUTE_FILE_NAME (file) || no_gnu_extensions)
+    return;
+
+  for (incl = dir_list; incl != NULL; incl = incl->next)
+    {
+      name = file_name_concat (incl->dir, file, NULL);
+      found = m4_prefetch (name);
+      free (name);
+      if (found)
+        return;
+    }
+#endif /* HAVE_POSIX_FADVISE */
+}
+
 #ifdef DEBUG_INCL
 
 static void MAYBE_UNUSED
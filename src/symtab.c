@@ -95,6 +95,12 @@ profile_strcmp (const char *s1, const char *s2)
 /* Pointer to symbol table.  */
 static symbol **symtab;
 
+/* Statistics for --stats: calls to lookup_symbol, how many of them
+   found the name, and how many list entries were examined.  */
+static uintmax_t lookup_count;
+static uintmax_t lookup_hits;
+static uintmax_t lookup_probes;
+
 void
 symtab_init (void)
 {
@@ -133,6 +139,428 @@ hash (const char *s)
   return val;
 }
 
+/*-------------------------------------------------------------------.
+| Symbols, their names and their definitions are allocated from a    |
+| common arena, so that defining and redefining macros in a loop     |
+| does not go through malloc each time.  Released symbols go on a    |
+| free list.  Strings are given a slot whose size is a power of two, |
+| and released slots go on a free list for their size.  A definition |
+| that fits in the slot of the one it replaces is copied over it.    |
+| Strings too long for the largest slot use malloc directly.         |
+|                                                                    |
+| Equal definitions share their text, which is preceded in its slot  |
+| by a count of the symbols using it; a shared text is never written |
+| over, a symbol whose definition changes gets a copy of its own.    |
+`-------------------------------------------------------------------*/
+
+/* Slots are TEXT_SLOT_MIN << N bytes, for N below TEXT_SLOT_CLASSES;
+   the smallest is large enough to hold the free list link.  */
+#define TEXT_SLOT_MIN 16
+#define TEXT_SLOT_CLASSES 9
+
+static struct obstack symbol_arena;
+static bool symbol_arena_ready;
+static symbol *free_symbols;
+static char *free_slots[TEXT_SLOT_CLASSES];
+
+/* Statistics for --stats: bytes taken from the arena, bytes of it in
+   use by live symbols and strings, bytes on the free lists, the
+   definitions copied over their predecessor, those sharing another
+   one's text, and the redefinitions that left the text unchanged.  */
+static size_t arena_bytes;
+static size_t arena_used;
+static size_t arena_pooled;
+static uintmax_t text_reuse_count;
+static uintmax_t text_share_count;
+static uintmax_t text_same_count;
+
+/* The count of users of a definition text.  */
+#define TEXT_REFS(T) (((size_t *) (T))[-1])
+#define TEXT_HEADER sizeof (size_t)
+
+/* The text last offered by defn, with a reference of its own.  */
+static char *offered_text;
+static size_t offered_size;
+static size_t offered_length;
+
+static void *
+arena_alloc (size_t size)
+{
+  if (!symbol_arena_ready)
+    {
+      obstack_init (&symbol_arena);
+      symbol_arena_ready = true;
+    }
+  arena_bytes += size;
+  return obstack_alloc (&symbol_arena, size);
+}
+
+/* Return a symbol, with no definition text.  */
+static symbol *
+alloc_symbol (void)
+{
+  symbol *sym = free_symbols;
+
+  if (sym != NULL)
+    {
+      free_symbols = sym->next;
+      arena_pooled -= sizeof *sym;
+    }
+  else
+    sym = (symbol *) arena_alloc (sizeof *sym);
+  arena_used += sizeof *sym;
+  sym->text_size = 0;
+  return sym;
+}
+
+static void
+release_symbol (symbol *sym)
+{
+  sym->next = free_symbols;
+  free_symbols = sym;
+  arena_used -= sizeof *sym;
+  arena_pooled += sizeof *sym;
+}
+
+/* Return the class of slot that holds SIZE bytes, which is
+   TEXT_SLOT_CLASSES if the string is too long for any.  */
+static int ATTRIBUTE_CONST
+slot_class (size_t size)
+{
+  int class = 0;
+
+  while (class < TEXT_SLOT_CLASSES && (size_t) TEXT_SLOT_MIN << class < size)
+    class++;
+  return class;
+}
+
+/* Return storage for a string of SIZE bytes, including its NUL, and
+   store the size actually available in *CAPACITY.  */
+static char *
+alloc_text (size_t size, size_t *capacity)
+{
+  int class = slot_class (size);
+  char *text;
+
+  if (class == TEXT_SLOT_CLASSES)
+    {
+      *capacity = size;
+      return xcharalloc (size);
+    }
+  *capacity = (size_t) TEXT_SLOT_MIN << class;
+  text = free_slots[class];
+  if (text != NULL)
+    {
+      memcpy (&free_slots[class], text, sizeof (char *));
+      arena_pooled -= *capacity;
+    }
+  else
+    text = (char *) arena_alloc (*capacity);
+  arena_used += *capacity;
+  return text;
+}
+
+/* Release TEXT, which was given CAPACITY bytes by alloc_text ().  */
+static void
+release_text (char *text, size_t capacity)
+{
+  int class = slot_class (capacity);
+
+  if (class == TEXT_SLOT_CLASSES)
+    {
+      free (text);
+      return;
+    }
+  memcpy (text, &free_slots[class], sizeof (char *));
+  free_slots[class] = text;
+  arena_used -= capacity;
+  arena_pooled += capacity;
+}
+
+/* Names are interned: each distinct name is stored once, in a slot
+   after a header, and shared by all the symbols of that name and by
+   the input blocks of files read under it.  A name is given an id
+   that no other name gets during the run, for the trace log.  */
+typedef struct name_header name_header;
+struct name_header
+{
+  name_header *next;            /* bucket chain */
+  size_t hash;
+  size_t refs;                  /* users of the name */
+  int32_t id;
+};
+
+#define NAME_HEADER(N) ((name_header *) (N) - 1)
+
+static name_header **name_table;
+static size_t name_table_size;  /* a power of 2 */
+static size_t name_count;
+static int32_t name_id_count;
+
+/* Double the number of buckets of name_table.  */
+static void
+grow_name_table (void)
+{
+  size_t old_size = name_table_size;
+  name_header **old = name_table;
+  name_header *np;
+  size_t i;
+
+  name_table_size = old_size ? old_size * 2 : 256;
+  name_table = (name_header **) xcalloc (name_table_size, sizeof *name_table);
+  for (i = 0; i < old_size; i++)
+    while ((np = old[i]) != NULL)
+      {
+        old[i] = np->next;
+        np->next = name_table[np->hash & (name_table_size - 1)];
+        name_table[np->hash & (name_table_size - 1)] = np;
+      }
+  free (old);
+}
+
+/* Return the interned copy of NAME, whose hash is H, with one more
+   user.  */
+static char *
+intern_hashed (const char *name, size_t h)
+{
+  name_header *np;
+  size_t length;
+  size_t capacity;
+
+  if (name_table_size != 0)
+    for (np = name_table[h & (name_table_size - 1)]; np != NULL;
+         np = np->next)
+      if (np->hash == h && STREQ ((char *) (np + 1), name))
+        {
+          np->refs++;
+          return (char *) (np + 1);
+        }
+
+  if (name_count >= name_table_size)
+    grow_name_table ();
+  length = strlen (name);
+  np = (name_header *) alloc_text (sizeof *np + length + 1, &capacity);
+  np->hash = h;
+  np->refs = 1;
+  np->id = name_id_count++;
+  memcpy (np + 1, name, length + 1);
+  np->next = name_table[h & (name_table_size - 1)];
+  name_table[h & (name_table_size - 1)] = np;
+  name_count++;
+  return (char *) (np + 1);
+}
+
+/*------------------------------------------------------------------.
+| Return the interned copy of NAME, for a new user, who must give   |
+| it back with release_name () when done.  Interned names can be    |
+| compared by address.                                              |
+`------------------------------------------------------------------*/
+
+char *
+intern_name (const char *name)
+{
+  return intern_hashed (name, hash (name));
+}
+
+/* Return the interned NAME, for one more user.  */
+static char *
+hold_name (char *name)
+{
+  NAME_HEADER (name)->refs++;
+  return name;
+}
+
+/* Give back the interned NAME, releasing it after its last user.  */
+void
+release_name (char *name)
+{
+  name_header *np = NAME_HEADER (name);
+  name_header **npp;
+  size_t size;
+  int class;
+
+  if (--np->refs > 0)
+    return;
+  for (npp = &name_table[np->hash & (name_table_size - 1)]; *npp != np;
+       npp = &(*npp)->next)
+    ;
+  *npp = np->next;
+  name_count--;
+  size = sizeof *np + strlen (name) + 1;
+  class = slot_class (size);
+  release_text ((char *) np, (class == TEXT_SLOT_CLASSES
+                              ? size : (size_t) TEXT_SLOT_MIN << class));
+}
+
+/* Return the id of the interned NAME.  */
+int32_t
+name_id (const char *name)
+{
+  return NAME_HEADER (name)->id;
+}
+
+/* Return storage for a definition text of SIZE bytes, used by one
+   symbol, and store the size actually available in *CAPACITY.  */
+static char *
+alloc_definition (size_t size, size_t *capacity)
+{
+  char *text = alloc_text (size + TEXT_HEADER, capacity) + TEXT_HEADER;
+
+  *capacity -= TEXT_HEADER;
+  TEXT_REFS (text) = 1;
+  return text;
+}
+
+/* Drop one use of the definition TEXT, of CAPACITY bytes, and release
+   it when that was the last.  */
+static void
+release_definition (char *text, size_t capacity)
+{
+  if (--TEXT_REFS (text) == 0)
+    release_text (text - TEXT_HEADER, capacity + TEXT_HEADER);
+}
+
+/* Forget the text offered by defn, if any.  */
+static void
+withdraw_offer (void)
+{
+  if (offered_text != NULL)
+    {
+      release_definition (offered_text, offered_size);
+      offered_text = NULL;
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Offer the definition text of the symbol SYM, which defn has just   |
+| expanded, for sharing with the next symbol to be defined the same. |
+| This is what lets define(`b', defn(`a')) share the text of a,      |
+| even though it reaches define as a copy.                           |
+`-------------------------------------------------------------------*/
+
+void
+offer_symbol_text (symbol *sym)
+{
+  withdraw_offer ();
+  offered_text = SYMBOL_TEXT (sym);
+  offered_size = sym->text_size;
+  offered_length = sym->text_length;
+  TEXT_REFS (offered_text)++;
+}
+
+/* Make the symbol SYM use the definition TEXT, of LENGTH bytes in
+   CAPACITY, which is already in use elsewhere.  */
+static void
+share_text (symbol *sym, char *text, size_t capacity, size_t length)
+{
+  TEXT_REFS (text)++;
+  if (SYMBOL_TYPE (sym) == TOKEN_TEXT)
+    release_definition (SYMBOL_TEXT (sym), sym->text_size);
+  SYMBOL_TYPE (sym) = TOKEN_TEXT;
+  SYMBOL_TEXT (sym) = text;
+  sym->text_size = capacity;
+  sym->text_length = length;
+  text_share_count++;
+}
+
+/* Return true if SYM is non-NULL and defined as the LENGTH bytes of
+   TEXT.  */
+static bool
+defined_as (symbol *sym, const char *text, size_t length)
+{
+  return (sym != NULL && SYMBOL_TYPE (sym) == TOKEN_TEXT
+          && sym->text_length == length
+          && memcmp (SYMBOL_TEXT (sym), text, length) == 0);
+}
+
+/*-------------------------------------------------------------------.
+| Make TEXT the definition of the symbol SYM.  A text equal to the   |
+| definition below SYM on its pushdef stack, or to the one offered   |
+| by defn, is shared rather than copied.  Otherwise the storage of   |
+| the current definition text is reused, when that is big enough     |
+| and not shared.                                                    |
+`-------------------------------------------------------------------*/
+
+void
+set_symbol_text (symbol *sym, const char *text)
+{
+  size_t length = strlen (text);
+  size_t size = length + 1;
+
+  if (defined_as (sym, text, length))
+    {
+      text_same_count++;
+      return;
+    }
+  if (SYMBOL_TYPE (sym) == TOKEN_TEXT && SYMBOL_TEXT (sym) == offered_text)
+    withdraw_offer ();
+
+  if (defined_as (SYMBOL_STACK (sym), text, length))
+    share_text (sym, SYMBOL_TEXT (SYMBOL_STACK (sym)),
+                SYMBOL_STACK (sym)->text_size, length);
+  else if (offered_text != NULL && offered_length == length
+           && memcmp (offered_text, text, length) == 0)
+    share_text (sym, offered_text, offered_size, length);
+  else
+    {
+      if (SYMBOL_TYPE (sym) == TOKEN_TEXT && size <= sym->text_size
+          && TEXT_REFS (SYMBOL_TEXT (sym)) == 1)
+        text_reuse_count++;
+      else
+        {
+          if (SYMBOL_TYPE (sym) == TOKEN_TEXT)
+            release_definition (SYMBOL_TEXT (sym), sym->text_size);
+          SYMBOL_TYPE (sym) = TOKEN_TEXT;
+          SYMBOL_TEXT (sym) = alloc_definition (size, &sym->text_size);
+        }
+      memmove (SYMBOL_TEXT (sym), text, size);
+      sym->text_length = length;
+    }
+}
+
+/*-------------------------------------------------------------------.
+| Append TEXT to the definition text of the symbol SYM, and return a |
+| pointer to where the copy of TEXT starts.  The storage grows at    |
+| least twofold when it is too small, so that building a long        |
+| definition piece by piece takes time linear in its length.  A      |
+| shared definition is copied first.                                 |
+`-------------------------------------------------------------------*/
+
+char *
+append_symbol_text (symbol *sym, const char *text)
+{
+  size_t length = strlen (text);
+  size_t size = sym->text_length + length + 1;
+  char *old = SYMBOL_TEXT (sym);
+
+  if (old == offered_text)
+    withdraw_offer ();
+  if (size > sym->text_size || TEXT_REFS (old) > 1)
+    {
+      size_t capacity = sym->text_size;
+
+      if (capacity < size)
+        capacity *= 2;
+      if (capacity < size)
+        capacity = size;
+      if (TEXT_REFS (old) == 1
+          && slot_class (sym->text_size + TEXT_HEADER) == TEXT_SLOT_CLASSES)
+        SYMBOL_TEXT (sym) = ((char *) xrealloc (old - TEXT_HEADER,
+                                                capacity + TEXT_HEADER)
+                             + TEXT_HEADER);
+      else
+        {
+          SYMBOL_TEXT (sym) = alloc_definition (capacity, &capacity);
+          memcpy (SYMBOL_TEXT (sym), old, sym->text_length);
+          release_definition (old, sym->text_size);
+        }
+      sym->text_size = capacity;
+    }
+  memcpy (SYMBOL_TEXT (sym) + sym->text_length, text, length + 1);
+  sym->text_length += length;
+  return SYMBOL_TEXT (sym) + sym->text_length - length;
+}
+
 /*--------------------------------------------.
 | Free all storage associated with a symbol.  |
 `--------------------------------------------*/
@@ -141,20 +569,13 @@ void
 free_symbol (symbol *sym)
 {
   if (SYMBOL_PENDING_EXPANSIONS (sym) > 0)
-    {
-      SYMBOL_DELETED (sym) = true;
-      if (SYMBOL_STACK (sym)) {
-        SYMBOL_NAME (sym) = xstrdup (SYMBOL_NAME (sym));
-        SYMBOL_STACK (sym) = NULL;
-      }
-    }
+    SYMBOL_DELETED (sym) = true;
   else
     {
-      if (SYMBOL_STACK (sym) == NULL)
-        free (SYMBOL_NAME (sym));
+      release_name (SYMBOL_NAME (sym));
       if (SYMBOL_TYPE (sym) == TOKEN_TEXT)
-        free (SYMBOL_TEXT (sym));
-      free (sym);
+        release_definition (SYMBOL_TEXT (sym), sym->text_size);
+      release_symbol (sym);
     }
 }
 
@@ -186,15 +607,19 @@ lookup_symbol (const char *name, symbol_lookup mode)
 
   h = hash (name);
   sym = symtab[h % hash_table_size];
+  lookup_count++;
 
   for (prev = NULL; sym != NULL; prev = sym, sym = sym->next)
     {
+      lookup_probes++;
       cmp = (h > sym->hash) - (h < sym->hash);
       if (cmp == 0)
         cmp = strcmp (SYMBOL_NAME (sym), name);
       if (cmp >= 0)
         break;
     }
+  if (cmp == 0)
+    lookup_hits++;
 
   /* If just searching, return status of search.  */
 
@@ -222,13 +647,14 @@ lookup_symbol (const char *name, symbol_lookup mode)
               symbol *old = sym;
               SYMBOL_DELETED (old) = true;
 
-              sym = (symbol *) xmalloc (sizeof (symbol));
+              sym = alloc_symbol ();
               SYMBOL_TYPE (sym) = TOKEN_VOID;
               SYMBOL_TRACED (sym) = SYMBOL_TRACED (old);
               sym->hash = h;
-              SYMBOL_NAME (sym) = SYMBOL_NAME (old);
+              SYMBOL_NAME (sym) = hold_name (SYMBOL_NAME (old));
               SYMBOL_MACRO_ARGS (sym) = false;
               SYMBOL_BLIND_NO_ARGS (sym) = false;
+              SYMBOL_LAZY_BRANCHES (sym) = false;
               SYMBOL_DELETED (sym) = false;
               SYMBOL_PENDING_EXPANSIONS (sym) = 0;
 
@@ -247,12 +673,13 @@ lookup_symbol (const char *name, symbol_lookup mode)
       /* Insert a name in the symbol table.  If there is already a symbol
          with the name, insert this in front of it.  */
 
-      sym = (symbol *) xmalloc (sizeof (symbol));
+      sym = alloc_symbol ();
       SYMBOL_TYPE (sym) = TOKEN_VOID;
       SYMBOL_TRACED (sym) = false;
       sym->hash = h;
       SYMBOL_MACRO_ARGS (sym) = false;
       SYMBOL_BLIND_NO_ARGS (sym) = false;
+      SYMBOL_LAZY_BRANCHES (sym) = false;
       SYMBOL_DELETED (sym) = false;
       SYMBOL_PENDING_EXPANSIONS (sym) = 0;
 
@@ -266,10 +693,10 @@ lookup_symbol (const char *name, symbol_lookup mode)
           sym->next = SYMBOL_STACK (sym)->next;
           SYMBOL_STACK (sym)->next = NULL;
           SYMBOL_TRACED (sym) = SYMBOL_TRACED (SYMBOL_STACK (sym));
-          SYMBOL_NAME (sym) = SYMBOL_NAME (SYMBOL_STACK (sym));
+          SYMBOL_NAME (sym) = hold_name (SYMBOL_NAME (SYMBOL_STACK (sym)));
         }
       else
-        SYMBOL_NAME (sym) = xstrdup (name);
+        SYMBOL_NAME (sym) = intern_hashed (name, h);
       return sym;
 
     case SYMBOL_DELETE:
@@ -310,13 +737,14 @@ lookup_symbol (const char *name, symbol_lookup mode)
         while (next != NULL && mode == SYMBOL_DELETE);
         if (traced)
           {
-            sym = (symbol *) xmalloc (sizeof (symbol));
+            sym = alloc_symbol ();
             SYMBOL_TYPE (sym) = TOKEN_VOID;
             SYMBOL_TRACED (sym) = true;
             sym->hash = h;
-            SYMBOL_NAME (sym) = xstrdup (name);
+            SYMBOL_NAME (sym) = intern_hashed (name, h);
             SYMBOL_MACRO_ARGS (sym) = false;
             SYMBOL_BLIND_NO_ARGS (sym) = false;
+            SYMBOL_LAZY_BRANCHES (sym) = false;
             SYMBOL_DELETED (sym) = false;
             SYMBOL_PENDING_EXPANSIONS (sym) = 0;
 
@@ -365,6 +793,25 @@ hack_all_symbols (hack_symbol *func, void *data)
         }
     }
 }
+
+/*----------------------------------------------.
+| Print symbol table statistics, for --stats.   |
+`----------------------------------------------*/
+
+void
+symtab_print_stats (void)
+{
+  stats_message ("symbols: %ju lookups, %ju hits, %ju misses, "
+                 "%ju chain probes, %zu names interned", lookup_count,
+                 lookup_hits, lookup_count - lookup_hits, lookup_probes,
+                 name_count);
+  stats_message ("symbol memory: %zu bytes in arena, %zu in use, "
+                 "%zu free in pools (%.1f%% fragmentation), "
+                 "%ju definitions rewritten in place, %ju shared, "
+                 "%ju unchanged", arena_bytes, arena_used, arena_pooled,
+                 arena_bytes ? 100.0 * arena_pooled / arena_bytes : 0.0,
+                 text_reuse_count, text_share_count, text_same_count);
+}
 
 #ifdef DEBUG_SYM
 